@@ -54,6 +54,8 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_arena.h"
+#include "kma_magazine.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -212,11 +214,52 @@ main(int argc, char* argv[])
   fclose(allocTrace);
 #endif
   
+#ifdef KMA_MAGAZINE
+  // buffers cached in magazines still hold their pages
+  kma_magazine_reap();
+#endif
   
   stat = page_stats();
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page Runs/Pages in Runs: %d/%d\n",
+	 stat->num_runs, stat->num_run_pages);
+  printf("Pool Rebuilds/Trimmed Pages: %d/%d\n",
+	 stat->num_rebuilds, stat->num_trimmed);
+  printf("Purged/Refaulted Pages: %d/%d\n",
+	 stat->num_purged, stat->num_refaulted);
+  printf("Huge Page Regions Touched: %d\n", stat->num_huge_regions);
+  printf("Page System Calls: %d\n", stat->num_syscalls);
+  printf("Page Faults/Simulated Cost: %d/%.3f ms\n",
+	 stat->num_faults, stat->sim_cost / 1e6);
+  
+#if defined(KMA_BUD) || defined(KMA_LZBUD)
+  kma_bud_stat_t* bstat = bud_stats();
+  
+  printf("Buddy Splits/Merges: %d/%d\n",
+	 bstat->num_splits, bstat->num_merges);
+  printf("Lazy Frees/Reuses: %d/%d\n",
+	 bstat->num_lazy_frees, bstat->num_lazy_reuses);
+#endif
+  
+#ifdef KMA_MAGAZINE
+  kma_magazine_stat_t* mstat = magazine_stats();
+  
+  printf("Magazine Backend Buffers/Exchanges: %d/%d\n",
+	 mstat->num_backend, mstat->num_exchanges);
+  printf("Magazine Contended/Max Rounds: %d/%d\n",
+	 mstat->num_contended, mstat->max_rounds);
+#endif
+  
+#ifdef KMA_CONCURRENT
+  kma_arena_stat_t* astat = arena_stats();
+  
+  printf("Arenas/Spills/Remote Frees: %d/%d/%d\n",
+	 astat->num_arenas, astat->num_spills, astat->num_remote_frees);
+  printf("Page Magazine Refills/Flushes: %d/%d\n",
+	 stat->num_refills, stat->num_flushes);
+#endif
   
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -272,9 +315,9 @@ allocate(mem_t* requests, int req_id, int req_size)
   new->size = req_size;
   new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response in some cases... engines that serve
+  // requests larger than a page may also return memory for them
+  if((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
@@ -65,6 +65,25 @@
 
 typedef int kma_size_t;
 
+// the layers above an engine, the arenas of KMA_CONCURRENT and the
+// magazines of KMA_MAGAZINE, provide kma_malloc() and kma_free() and
+// call the layer below under another name, see kma_arena.h
+#if defined(__KMA_IMPL__) && (defined(KMA_CONCURRENT) || defined(KMA_MAGAZINE))
+#define kma_malloc engine_malloc
+#define kma_free engine_free
+#elif defined(__KARENA_IMPL__) && defined(KMA_MAGAZINE)
+#define kma_malloc arena_malloc
+#define kma_free arena_free
+#endif
+
+typedef struct
+{
+  int num_splits;       // buffers split into two buddies
+  int num_merges;       // buddies coalesced into one buffer
+  int num_lazy_frees;   // frees that skipped coalescing (lazy buddy)
+  int num_lazy_reuses;  // allocations of a locally free buffer (lazy buddy)
+} kma_bud_stat_t;
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -91,6 +110,17 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+#if defined(KMA_BUD) || defined(KMA_LZBUD)
+/***********************************************************************
+ *  Title: Buddy statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the split and merge counters of the buddy allocators
+ *    Input: none
+ *    Output: the buddy statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_bud_stat_t* bud_stats();
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
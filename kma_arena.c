@@ -0,0 +1,187 @@
+/***************************************************************************
+ *  Title: Arenas
+ * -------------------------------------------------------------------------
+ *    Purpose: Per thread arenas that make any engine safe to call from
+ *             several threads
+ ***************************************************************************/
+#ifdef KMA_CONCURRENT
+#define __KARENA_IMPL__
+
+/************System include***********************************************/
+#include <pthread.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma_arena.h"
+#ifdef KMA_SLAB
+#include "kma_slab.h"
+#endif
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+static pthread_mutex_t gArenaLock[NUMARENAS] =
+  { [0 ... NUMARENAS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+// threads get their home arena round robin on their first request
+static int gNextArena = 0;
+static __thread int gHome = -1;
+
+static kma_arena_stat_t gArenaStats = { NUMARENAS, 0, 0 };
+
+/************Function Prototypes******************************************/
+static int lockArena();
+static int lockOwner(void* ptr);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int arena = lockArena();
+  void* ptr;
+
+  kma_arena = arena;
+  ptr = engine_malloc(size);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  // memory goes back to the arena whose engine took its page
+  int arena = lockOwner(ptr);
+
+  if (arena != gHome)
+    {
+      __atomic_fetch_add(&gArenaStats.num_remote_frees, 1, __ATOMIC_RELAXED);
+    }
+  engine_free(ptr, size);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+}
+
+#ifdef KMA_SLAB
+// an object cache is created in the home arena of the thread, and its
+// descriptor, slabs and objects stay in that arena, so every other call
+// locks the arena of the descriptor, whichever thread makes it
+kmem_cache_t*
+kmem_cache_create(char* name, kma_size_t size, kma_size_t align,
+		  kmem_cache_fn_t ctor, kmem_cache_fn_t dtor)
+{
+  int arena = lockArena();
+  kmem_cache_t* cache;
+
+  kma_arena = arena;
+  cache = engine_cache_create(name, size, align, ctor, dtor);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+
+  return cache;
+}
+
+void*
+kmem_cache_alloc(kmem_cache_t* cache)
+{
+  int arena = lockOwner(cache);
+  void* obj;
+
+  obj = engine_cache_alloc(cache);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+
+  return obj;
+}
+
+void
+kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+  int arena = lockOwner(cache);
+
+  if (arena != gHome)
+    {
+      __atomic_fetch_add(&gArenaStats.num_remote_frees, 1, __ATOMIC_RELAXED);
+    }
+  engine_cache_free(cache, obj);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+}
+
+void
+kmem_cache_reap(kmem_cache_t* cache)
+{
+  int arena = lockOwner(cache);
+
+  engine_cache_reap(cache);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+}
+
+void
+kmem_cache_destroy(kmem_cache_t* cache)
+{
+  int arena = lockOwner(cache);
+
+  engine_cache_destroy(cache);
+  pthread_mutex_unlock(&gArenaLock[arena]);
+}
+#endif
+
+kma_arena_stat_t*
+arena_stats()
+{
+  static kma_arena_stat_t stats;
+
+  return memcpy(&stats, &gArenaStats, sizeof(kma_arena_stat_t));
+}
+
+// lock the arena whose engine took the page of ptr
+static int
+lockOwner(void* ptr)
+{
+  int arena = page_arena(ptr);
+
+  pthread_mutex_lock(&gArenaLock[arena]);
+  kma_arena = arena;
+
+  return arena;
+}
+
+// lock the home arena of the thread, or the next one that is not busy
+// when it is, only when every arena is busy wait for the home arena
+static int
+lockArena()
+{
+  int i;
+
+  if (gHome < 0)
+    {
+      gHome = __atomic_fetch_add(&gNextArena, 1, __ATOMIC_RELAXED)
+	% NUMARENAS;
+    }
+
+  for (i = 0; i < NUMARENAS; i++)
+    {
+      int arena = (gHome + i) % NUMARENAS;
+
+      if (pthread_mutex_trylock(&gArenaLock[arena]) == 0)
+	{
+	  if (i > 0)
+	    {
+	      __atomic_fetch_add(&gArenaStats.num_spills, 1, __ATOMIC_RELAXED);
+	    }
+	  return arena;
+	}
+    }
+
+  pthread_mutex_lock(&gArenaLock[gHome]);
+  return gHome;
+}
+
+#endif // KMA_CONCURRENT
@@ -0,0 +1,107 @@
+/***************************************************************************
+ *  Title: Arenas
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the per thread arenas of the concurrent build
+ ***************************************************************************/
+
+#ifndef __KARENA_H__
+#define __KARENA_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KARENA_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+// every engine keeps one copy of its state per arena. Built with
+// KMA_CONCURRENT the threads are spread over NUMARENAS arenas, each
+// behind a lock of its own, otherwise there is a single arena
+#ifdef KMA_CONCURRENT
+#ifndef NUMARENAS
+#define NUMARENAS 8
+#endif
+#else
+#define NUMARENAS 1
+#endif
+
+// the page tables keep the arena of a page in a byte
+#if NUMARENAS > 256
+#error "NUMARENAS is at most 256"
+#endif
+
+typedef struct
+{
+  int num_arenas;
+  int num_spills;        // requests served by another than the home arena
+  int num_remote_frees;  // frees into another than the home arena
+} kma_arena_stat_t;
+
+/************Global Variables*********************************************/
+
+#ifdef KMA_CONCURRENT
+// the arena whose state the engine works on in the calling thread
+EXTERN __thread int kma_arena;
+#else
+#define kma_arena 0
+#endif
+
+/************Function Prototypes******************************************/
+
+#if defined(KMA_CONCURRENT) || defined(KMA_MAGAZINE)
+/***********************************************************************
+ *  Title: Engine entry points
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_malloc() and kma_free() of the engine, which the
+ *             arenas call with the arena locked and kma_arena set, or
+ *             the magazines when there are no arenas
+ *    Input: as kma_malloc() and kma_free()
+ *    Output: as kma_malloc() and kma_free()
+ ***********************************************************************/
+EXTERN void* engine_malloc(kma_size_t size);
+EXTERN void engine_free(void* ptr, kma_size_t size);
+#endif
+
+#if defined(KMA_CONCURRENT) && defined(KMA_MAGAZINE)
+/***********************************************************************
+ *  Title: Arena entry points
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_malloc() and kma_free() of the arenas, which the
+ *             magazines call
+ *    Input: as kma_malloc() and kma_free()
+ *    Output: as kma_malloc() and kma_free()
+ ***********************************************************************/
+EXTERN void* arena_malloc(kma_size_t size);
+EXTERN void arena_free(void* ptr, kma_size_t size);
+#endif
+
+#ifdef KMA_CONCURRENT
+
+/***********************************************************************
+ *  Title: Arena statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of arenas and how often threads had to
+ *             use another arena than their own
+ *    Input: none
+ *    Output: the arena statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_arena_stat_t* arena_stats();
+#endif
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KARENA_H__ */
@@ -0,0 +1,338 @@
+/***************************************************************************
+ *  Title: Allocation Bitmaps
+ * -------------------------------------------------------------------------
+ *    Purpose: Word parallel bitmaps shared by the bitmap based engines
+ ***************************************************************************/
+#define __KBITMAP_IMPL__
+
+/************System include***********************************************/
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_bitmap.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define ALLBITS (~(kma_bitmap_t)0)
+
+// bits [from, to) of a word, 0 <= from < to <= 64
+#define WORDMASK(from, to) \
+  ((ALLBITS >> (BITMAP_BITS - ((to) - (from)))) << (from))
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+static int findRun(kma_bitmap_t* map, int from, int nbits, int count);
+static int skipFull(kma_bitmap_t* map, int word, int nwords);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void
+bitmap_set(kma_bitmap_t* map, int first, int count)
+{
+  int last = first + count;
+  int word = first / BITMAP_BITS;
+  int end = last / BITMAP_BITS;
+
+  if (count <= 0)
+    {
+      return;
+    }
+
+  if (word == end)
+    {
+      map[word] |= WORDMASK(first % BITMAP_BITS, last % BITMAP_BITS);
+      return;
+    }
+
+  if (first % BITMAP_BITS)
+    {
+      map[word++] |= WORDMASK(first % BITMAP_BITS, BITMAP_BITS);
+    }
+  while (word < end)
+    {
+      map[word++] = ALLBITS;
+    }
+  if (last % BITMAP_BITS)
+    {
+      map[end] |= WORDMASK(0, last % BITMAP_BITS);
+    }
+}
+
+void
+bitmap_clear(kma_bitmap_t* map, int first, int count)
+{
+  int last = first + count;
+  int word = first / BITMAP_BITS;
+  int end = last / BITMAP_BITS;
+
+  if (count <= 0)
+    {
+      return;
+    }
+
+  if (word == end)
+    {
+      map[word] &= ~WORDMASK(first % BITMAP_BITS, last % BITMAP_BITS);
+      return;
+    }
+
+  if (first % BITMAP_BITS)
+    {
+      map[word++] &= ~WORDMASK(first % BITMAP_BITS, BITMAP_BITS);
+    }
+  while (word < end)
+    {
+      map[word++] = 0;
+    }
+  if (last % BITMAP_BITS)
+    {
+      map[end] &= ~WORDMASK(0, last % BITMAP_BITS);
+    }
+}
+
+bool
+bitmap_isclear(kma_bitmap_t* map, int first, int count)
+{
+  int last = first + count;
+  int word = first / BITMAP_BITS;
+  int end = last / BITMAP_BITS;
+  kma_bitmap_t used = 0;
+
+  if (count <= 0)
+    {
+      return TRUE;
+    }
+
+  if (word == end)
+    {
+      return (map[word]
+	      & WORDMASK(first % BITMAP_BITS, last % BITMAP_BITS)) == 0;
+    }
+
+  if (first % BITMAP_BITS)
+    {
+      used |= map[word++] & WORDMASK(first % BITMAP_BITS, BITMAP_BITS);
+    }
+  while (word < end)
+    {
+      used |= map[word++];
+    }
+  if (last % BITMAP_BITS)
+    {
+      used |= map[end] & WORDMASK(0, last % BITMAP_BITS);
+    }
+
+  return used == 0;
+}
+
+int
+bitmap_count(kma_bitmap_t* map, int first, int count)
+{
+  int last = first + count;
+  int word = first / BITMAP_BITS;
+  int end = last / BITMAP_BITS;
+  int bits = 0;
+
+  if (count <= 0)
+    {
+      return 0;
+    }
+
+  if (word == end)
+    {
+      return __builtin_popcountll(map[word]
+				  & WORDMASK(first % BITMAP_BITS,
+					     last % BITMAP_BITS));
+    }
+
+  if (first % BITMAP_BITS)
+    {
+      bits += __builtin_popcountll(map[word++]
+				   & WORDMASK(first % BITMAP_BITS,
+					      BITMAP_BITS));
+    }
+  while (word < end)
+    {
+      bits += __builtin_popcountll(map[word++]);
+    }
+  if (last % BITMAP_BITS)
+    {
+      bits += __builtin_popcountll(map[end] & WORDMASK(0, last % BITMAP_BITS));
+    }
+
+  return bits;
+}
+
+int
+bitmap_findclear(kma_bitmap_t* map, int nbits, int count, int align)
+{
+  int from = 0;
+
+  while (from < nbits)
+    {
+      int start = findRun(map, from, nbits, count);
+      int aligned;
+
+      if (start < 0)
+	{
+	  return -1;
+	}
+
+      // a run starting in front of the next multiple only helps if it
+      // still covers count bits from there
+      aligned = (start + align - 1) / align * align;
+      if (aligned == start
+	  || (aligned + count <= nbits
+	      && bitmap_isclear(map, aligned, count)))
+	{
+	  return aligned;
+	}
+      from = aligned + 1;
+    }
+
+  return -1;
+}
+
+int
+bitmap_findlast(kma_bitmap_t* map, int nbits)
+{
+  int word = BITMAP_WORDS(nbits) - 1;
+
+  if (nbits <= 0)
+    {
+      return -1;
+    }
+
+  // ignore the bits past nbits in the last word
+  if (nbits % BITMAP_BITS)
+    {
+      kma_bitmap_t last = map[word] & WORDMASK(0, nbits % BITMAP_BITS);
+      if (last)
+	{
+	  return word * BITMAP_BITS + BITMAP_BITS - 1 - __builtin_clzll(last);
+	}
+      word--;
+    }
+
+  for (; word >= 0; word--)
+    {
+      if (map[word])
+	{
+	  return word * BITMAP_BITS + BITMAP_BITS - 1
+	    - __builtin_clzll(map[word]);
+	}
+    }
+  return -1;
+}
+
+// the lowest run of count clear bits at or after bit from
+static int
+findRun(kma_bitmap_t* map, int from, int nbits, int count)
+{
+  int nwords = BITMAP_WORDS(nbits);
+  int start = 0;
+  int run = 0;
+  int i = from;
+
+  while (i < nbits && run < count)
+    {
+      int bit = i % BITMAP_BITS;
+      kma_bitmap_t word;
+      int zeros, ones;
+
+      // outside of a run whole words of set bits can be skipped
+      if (bit == 0 && run == 0)
+	{
+	  i = skipFull(map, i / BITMAP_BITS, nwords) * BITMAP_BITS;
+	  if (i >= nbits)
+	    {
+	      break;
+	    }
+	}
+
+      word = map[i / BITMAP_BITS] >> bit;
+      if (word == 0)
+	{
+	  // the rest of the word is clear
+	  if (run == 0)
+	    {
+	      start = i;
+	    }
+	  run += BITMAP_BITS - bit;
+	  i += BITMAP_BITS - bit;
+	  continue;
+	}
+
+      zeros = __builtin_ctzll(word);
+      if (zeros > 0)
+	{
+	  if (run == 0)
+	    {
+	      start = i;
+	    }
+	  run += zeros;
+	  if (run >= count)
+	    {
+	      break;
+	    }
+	}
+
+      // jump over the set bits that end the run
+      word = ~(word >> zeros);
+      ones = word ? __builtin_ctzll(word) : BITMAP_BITS;
+      run = 0;
+      i += zeros + ones;
+    }
+
+  if (run >= count && start + count <= nbits)
+    {
+      return start;
+    }
+  return -1;
+}
+
+// the first word at or after word that still has a clear bit
+static int
+skipFull(kma_bitmap_t* map, int word, int nwords)
+{
+#if defined(__AVX2__)
+  __m256i full = _mm256_set1_epi64x(-1);
+
+  while (word + 4 <= nwords)
+    {
+      __m256i v = _mm256_loadu_si256((__m256i*)(map + word));
+      if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, full)) != -1)
+	{
+	  break;
+	}
+      word += 4;
+    }
+#elif defined(__SSE2__)
+  __m128i full = _mm_set1_epi32(-1);
+
+  while (word + 2 <= nwords)
+    {
+      __m128i v = _mm_loadu_si128((__m128i*)(map + word));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, full)) != 0xFFFF)
+	{
+	  break;
+	}
+      word += 2;
+    }
+#endif
+  while (word < nwords && map[word] == ALLBITS)
+    {
+      word++;
+    }
+  return word;
+}
@@ -0,0 +1,105 @@
+/***************************************************************************
+ *  Title: Allocation Bitmaps
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the bitmaps keeping allocation state
+ ***************************************************************************/
+
+#ifndef __KBITMAP_H__
+#define __KBITMAP_H__
+
+/************System include***********************************************/
+#include <stdint.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KBITMAP_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+// a bitmap is an array of words, bit i is bit i%64 of word i/64
+typedef uint64_t kma_bitmap_t;
+
+#define BITMAP_BITS 64
+
+// number of words needed for a bitmap of n bits
+#define BITMAP_WORDS(n) (((n) + BITMAP_BITS - 1) / BITMAP_BITS)
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Sets a range of bits
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets count bits starting at bit first, a word at a time
+ *    Input: the bitmap, the first bit, the number of bits
+ *    Output: none
+ ***********************************************************************/
+EXTERN void bitmap_set(kma_bitmap_t* map, int first, int count);
+
+/***********************************************************************
+ *  Title: Clears a range of bits
+ * ---------------------------------------------------------------------
+ *    Purpose: Clears count bits starting at bit first, a word at a time
+ *    Input: the bitmap, the first bit, the number of bits
+ *    Output: none
+ ***********************************************************************/
+EXTERN void bitmap_clear(kma_bitmap_t* map, int first, int count);
+
+/***********************************************************************
+ *  Title: Tests a range of bits
+ * ---------------------------------------------------------------------
+ *    Purpose: Checks whether no bit of a range is set
+ *    Input: the bitmap, the first bit, the number of bits
+ *    Output: TRUE if all count bits starting at first are clear
+ ***********************************************************************/
+EXTERN bool bitmap_isclear(kma_bitmap_t* map, int first, int count);
+
+/***********************************************************************
+ *  Title: Counts set bits
+ * ---------------------------------------------------------------------
+ *    Purpose: Counts the set bits of a range, a word at a time
+ *    Input: the bitmap, the first bit, the number of bits
+ *    Output: the number of set bits among count bits from first
+ ***********************************************************************/
+EXTERN int bitmap_count(kma_bitmap_t* map, int first, int count);
+
+/***********************************************************************
+ *  Title: Finds a run of clear bits
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the lowest run of count clear bits that starts at
+ *             a multiple of align. Words with every bit set are
+ *             skipped several at a time with SSE2 or AVX2 when the
+ *             compiler targets them
+ *    Input: the bitmap, its size in bits, the length of the run, the
+ *           alignment of its first bit (1 for any)
+ *    Output: the first bit of the run or -1 if there is none
+ ***********************************************************************/
+EXTERN int bitmap_findclear(kma_bitmap_t* map, int nbits, int count,
+			    int align);
+
+/***********************************************************************
+ *  Title: Finds the last set bit
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the highest set bit below nbits, a word at a time
+ *    Input: the bitmap, its size in bits
+ *    Output: the index of the bit or -1 if no bit is set
+ ***********************************************************************/
+EXTERN int bitmap_findlast(kma_bitmap_t* map, int nbits);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KBITMAP_H__ */
@@ -45,6 +45,8 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_bitmap.h"
+#include "kma_arena.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -53,11 +55,29 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-#define PAGENUM 91
+// every bit of a page bitmap covers 16 bytes
+#define GRANULE 16
 
-typedef struct
+// pages are handed out in superblocks of 2^BUD_MAXPAGEORDER contiguous
+// pages, which is also the largest buffer the buddy system serves
+#ifndef BUD_MAXPAGEORDER
+#define BUD_MAXPAGEORDER 2
+#endif
+
+#define SUPERPAGES (1 << BUD_MAXPAGEORDER)
+#define SUPERSIZE (PAGESIZE * SUPERPAGES)
+
+// free lists from 16 bytes up to a whole superblock
+#define NUMORDERS (10 + BUD_MAXPAGEORDER)
+
+// superblocks are aligned to their size, so they are numbered by page_index()
+#define SUPERINDEX(addr) (page_index(addr) >> BUD_MAXPAGEORDER)
+
+// free buffers are linked both ways, so a buddy is unlinked in O(1)
+typedef struct bufferNode
 {
-	void* nextbuffer;
+	struct bufferNode* nextbuffer;
+	struct bufferNode* prevbuffer;
 } bufferNode_t;
 
 typedef struct
@@ -70,28 +90,54 @@ typedef struct
 {
 	kma_page_t*		ptr;// the origin res return by get page()
 	void*			addr;//the ptr.ptr, the start addr of the page
-	unsigned char	bitmap[64];// bit map, shows that the resource 
+	kma_bitmap_t	bitmap[BITMAP_WORDS(SUPERSIZE/GRANULE)];// bit map, shows that the resource 
 	int				numalloc;
 } kpageheader_t;
 
+#define PAGENUM ((PAGESIZE - 2 * sizeof(void*)) / sizeof(kpageheader_t))
+
+// a header page describes the PAGENUM superblocks whose SUPERINDEX() falls in its range
 typedef struct
 {
 	kma_page_t*		self;
 	int				numpages;// the number of page 
-	int				numalloc;// 0 means nothing//each page hold one 
-	headerList_t	freelist[10];
 	kpageheader_t	page[PAGENUM];
-	void*	nextPage;
 } pageList_t;
 
+// header pages needed to cover a pool of the given size
+#define NUMLISTS(pages) (((pages) / SUPERPAGES + PAGENUM - 1) / PAGENUM)
+
+typedef struct
+{
+	kma_page_t*		self;
+	int				numpages;// the number of page 
+	int				numalloc;// 0 means nothing//each page hold one 
+	unsigned int	nonempty;// bit i is set while freelist[i] has a buffer
+	headerList_t	freelist[NUMORDERS];
+	int				numlists;
+	pageList_t*		pagelist[];// sized from page_limit(), header page of SUPERINDEX() / PAGENUM
+} mainHeader_t;
+
+// the order of a free list, that is the bit it owns in nonempty
+#define ORDER(list) ((int)((list) - (*gEntry).freelist))
+
 /************Global Variables*********************************************/
 
-pageList_t* gEntry=0;
+// the state of every arena, gEntry and gStats are the ones the
+// calling thread works on, see kma_arena.h
+static mainHeader_t* gEntries[NUMARENAS];
+#define gEntry gEntries[kma_arena]
+
+static kma_bud_stat_t gArenaStats[NUMARENAS];
+#define gStats gArenaStats[kma_arena]
 
 /************Function Prototypes******************************************/
 
-pageList_t* initial_mainheader(kma_page_t* newpage);
+mainHeader_t* initial_mainheader();
+pageList_t* initial_pagelist(kma_page_t* newpage);
 void initial_pageheader(kpageheader_t* pageheader, kma_page_t* newpage);
+kpageheader_t* findPageHeader(void* addr);
+int findOrder(kma_size_t size);
 kma_size_t roundUp(kma_size_t size);
 int findFreeList(kma_size_t size);
 kpageheader_t* chkfreepage();
@@ -110,11 +156,11 @@ void emptybitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsiz
 void*
 kma_malloc(kma_size_t size)
 {
-	if ((size + sizeof(void*)) > PAGESIZE){ // requested size too large
+	if (size > SUPERSIZE){ // requested size too large
 		return NULL;
 	}
 	if(!gEntry){// initialized the entry
-		gEntry=initial_mainheader(get_page());
+		gEntry=initial_mainheader();
 	}
 	
 	int roundsize=roundUp(size);
@@ -131,22 +177,7 @@ kma_malloc(kma_size_t size)
 		thelist = splitBuffer(&((*gEntry).freelist[i]), roundsize);
 		ret = deleteTheFirstBufferFromFreelist(thelist);
 		
-		void* theaddr;
-		theaddr=(void*)(((long int)(((long int)ret-(long int)gEntry)/PAGESIZE))*PAGESIZE+(long int)gEntry);
-		pageList_t* temppage=gEntry;
-		// find the page header
-		while(!thepage){
-			for(i = 0; i < PAGENUM; ++i)
-			{
-				if((*temppage).page[i].addr==theaddr){
-					thepage=&((*temppage).page[i]);
-					break;
-				}
-			}
-			if((*temppage).nextPage==0)break;// it should find the page
-			if(thepage)break;
-			temppage=(*temppage).nextPage;
-		}
+		thepage=findPageHeader(ret);
 		fillbitmap(thepage, ret, roundsize);
 
 		(*gEntry).numalloc++;
@@ -154,10 +185,10 @@ kma_malloc(kma_size_t size)
 		return (void*)ret;		
 	}
 	else{
-		kpageheader_t* newpage=chkfreepage();// so we have the newpage. and it is available it freelist[9]
+		kpageheader_t* newpage=chkfreepage();// so we have the newpage. and it is available in the last freelist
 		headerList_t* thelist;
 		
-		thelist=splitBuffer(&((*gEntry).freelist[9]), roundsize);
+		thelist=splitBuffer(&((*gEntry).freelist[NUMORDERS-1]), roundsize);
 		ret=deleteTheFirstBufferFromFreelist(thelist);
 		fillbitmap(newpage, ret, roundsize);
 
@@ -174,35 +205,10 @@ kma_free(void* ptr, kma_size_t size)
 	int roundsize=roundUp(size);
 	
 	// find its page and its header
-	kpageheader_t* thepage=0;
-	headerList_t* thelist=0;
-	void* theaddr;
-	int i;
-	theaddr=(void*)(((long int)(((long int)ptr-(long int)gEntry)/PAGESIZE))*PAGESIZE+(long int)gEntry);
-	pageList_t* temppage=gEntry;
-	pageList_t* previouspage=0;
-	// find the page header
-	while(!thepage){
-		for(i = 0; i < PAGENUM; ++i)
-		{
-			if((*temppage).page[i].addr==theaddr){
-				thepage=&((*temppage).page[i]);
-				break;
-			}
-		}
-		if((*temppage).nextPage==0)break;// it should find the page
-		if(thepage)break;
-		previouspage=temppage;
-		temppage=(*temppage).nextPage;
-	}
-	// find the header
-	for(i = 0; i < 10; ++i)
-	{
-		if((*gEntry).freelist[i].size==roundsize){
-			break;
-		}
-	}
-	thelist=&((*gEntry).freelist[i]);
+	kpageheader_t* thepage=findPageHeader(ptr);
+	pageList_t* temppage=(*gEntry).pagelist[SUPERINDEX(ptr)/PAGENUM];
+	headerList_t* thelist=&((*gEntry).freelist[findOrder(size)]);
+	
 	insertbuffer(thelist,ptr);
 	emptybitmap(thepage, ptr, roundsize);
 	(*gEntry).numalloc--;
@@ -210,42 +216,59 @@ kma_free(void* ptr, kma_size_t size)
 	
 	
 	headerList_t* otherlist=combi_bud(thelist, thepage);
-//	if((*otherlist).size==8192){//the page is empty
 	if((*thepage).numalloc==0){
 		deleteTheFirstBufferFromFreelist(otherlist);
-		free_page((*thepage).ptr);
+		free_pages((*thepage).ptr);
 		(*thepage).ptr=0;
 		(*thepage).addr=0;
 		(*gEntry).numpages--;
 		(*temppage).numpages--;
-	}
-	if(((*temppage).numpages==0)&&(previouspage!=0))
-	{
-		(*previouspage).nextPage=(*temppage).nextPage;
-		free_page((*temppage).self);
+		if((*temppage).numpages==0)
+		{
+			(*gEntry).pagelist[SUPERINDEX(ptr)/PAGENUM]=0;
+			free_page((*temppage).self);
+		}
 	}
 	if((*gEntry).numpages==0)
 	{
-		free_page((*gEntry).self);
+		free_pages((*gEntry).self);
 		gEntry=0;
 	}
 	
 }
 
-pageList_t* initial_mainheader(kma_page_t* newpage){
-	pageList_t* ret;
+mainHeader_t* initial_mainheader(){
+	int numlists=NUMLISTS(page_limit());
+	int size=sizeof(mainHeader_t)+numlists*sizeof(pageList_t*);
+	kma_page_t* newpage=get_pages((size+PAGESIZE-1)/PAGESIZE);
+	mainHeader_t* ret;
 	
-	ret=(pageList_t*)(newpage->ptr);
+	ret=(mainHeader_t*)(newpage->ptr);
 	(*ret).self=newpage;
+	(*ret).numlists=numlists;
 	(*ret).numpages=0;
 	(*ret).numalloc=0;
-	(*ret).nextPage=0;
+	(*ret).nonempty=0;
 	int i;
-	for(i = 0; i < 10; ++i)
+	for(i = 0; i < NUMORDERS; ++i)
 	{
 		(*ret).freelist[i].size=16<<i;
 		(*ret).freelist[i].buffer=0;
 	}
+	for(i = 0; i < numlists; ++i)
+	{
+		(*ret).pagelist[i]=0;
+	}
+	return ret;
+}
+
+pageList_t* initial_pagelist(kma_page_t* newpage){
+	pageList_t* ret;
+	
+	ret=(pageList_t*)(newpage->ptr);
+	(*ret).self=newpage;
+	(*ret).numpages=0;
+	int i;
 	for(i = 0; i < PAGENUM; ++i)
 	{
 		(*ret).page[i].ptr=0;
@@ -254,106 +277,71 @@ pageList_t* initial_mainheader(kma_page_t* newpage){
 	return ret;
 }
 
+// the header of a superblock sits at a fixed slot given by its pool index
+kpageheader_t* findPageHeader(void* addr){
+	int index=SUPERINDEX(addr);
+	
+	return &((*(*gEntry).pagelist[index/PAGENUM]).page[index%PAGENUM]);
+}
+
 void initial_pageheader(kpageheader_t* pageheader, kma_page_t* newpage){
-	int j;
 	(*pageheader).ptr=newpage;
 	(*pageheader).addr=(void*)(newpage->ptr);
 	(*pageheader).numalloc=0;
-	for(j = 0; j < 64; ++j)
-	{
-		(*pageheader).bitmap[j]=0;
-	}
+	bitmap_clear((*pageheader).bitmap, 0, SUPERSIZE/GRANULE);
 	// add the whole page to free list
-	*((bufferNode_t**)((*pageheader).addr))=0;
-	insertbuffer(&((*gEntry).freelist[9]), (bufferNode_t*)((*pageheader).addr));
+	insertbuffer(&((*gEntry).freelist[NUMORDERS-1]), (bufferNode_t*)((*pageheader).addr));
+}
+
+// the free list of the smallest power of two holding size, 16 is order 0
+int findOrder(kma_size_t size){
+	if(size<=16)return 0;
+	return 28-__builtin_clz((unsigned int)(size-1));
 }
 
 kma_size_t roundUp(kma_size_t size){
-	kma_size_t ret=16;
-	while(size>ret){
-		ret=ret<<1;
-	}
-	return ret;
+	return 16<<findOrder(size);
 }
 
+// the lowest non-empty free list that can hold size, plus one, or 0
 int findFreeList(kma_size_t size){
-
-	int i;
-	int roundsize=roundUp(size);
-	for(i = 0; i < 10; ++i)
-	{
-		if((*gEntry).freelist[i].size>=roundsize){
-			if((*gEntry).freelist[i].buffer!=0)return i+1;
-		}
-	}
-	return 0;
+	unsigned int avail=(*gEntry).nonempty&(~0u<<findOrder(size));
+	
+	if(!avail)return 0;
+	return __builtin_ctz(avail)+1;
 }
 
 kpageheader_t* chkfreepage(){
-	kpageheader_t* ret=0;
-	pageList_t* temppage=gEntry;
-	int i;
+	kma_page_t* newpage=get_pages(SUPERPAGES);
+	int index=SUPERINDEX(newpage->ptr);
+	pageList_t* temppage=(*gEntry).pagelist[index/PAGENUM];
+	kpageheader_t* ret;
 	
-	// find the available page header
-	while(!ret){
-		for(i = 0; i < PAGENUM; ++i)
-		{
-			if((*temppage).page[i].ptr==0){
-				ret=&((*temppage).page[i]);
-				break;
-			}
-		}
-		if((*temppage).nextPage==0)break;
-		if(ret)break;
-		temppage=(*temppage).nextPage;
-	}
-	// if finding a page, then init it
-	if(ret!=0)
-	{
-		initial_pageheader(ret, get_page());
-		(*gEntry).numpages++;
-		(*temppage).numpages++;
-	}
-	// If there is no page yet, then create the header and page.
-	else{
-		(*temppage).nextPage=initial_mainheader(get_page());
-		temppage=(*temppage).nextPage;
-		ret=&((*temppage).page[0]);
-		initial_pageheader(ret, get_page());
-		(*gEntry).numpages++;
-		(*temppage).numpages++;
+	// the first page of a range brings its header page
+	if(!temppage){
+		temppage=initial_pagelist(get_page());
+		(*gEntry).pagelist[index/PAGENUM]=temppage;
 	}
+	ret=&((*temppage).page[index%PAGENUM]);
+	initial_pageheader(ret, newpage);
+	(*gEntry).numpages++;
+	(*temppage).numpages++;
 	
 	return ret;
 }
 
 //create the bitmap for storing the free states of buddy lists.
 void fillbitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
-	unsigned char* bitmap=(*pageheader).bitmap;
-	int i, offset, endbit;
-	offset=(int)(bufferptr-(*pageheader).addr);
-	endbit = offset + roundsize;
-	offset /= 16;
-	endbit /= 16;
+	int offset=(int)(bufferptr-(*pageheader).addr);
 	
-	for( i = offset; i < endbit; ++i)
-	{
-		bitmap[i/8] |= (1<<(i%8));
-	}
+	bitmap_set((*pageheader).bitmap, offset/GRANULE, roundsize/GRANULE);
 }
 
 // clear the bitmap
 void emptybitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
-	unsigned char* bitmap=(*pageheader).bitmap;
-	int i, offset, endbit;
-	offset=(int)(bufferptr-(*pageheader).addr);
-	endbit = offset + roundsize;
-	offset /= 16;
-	endbit /= 16;
-	for( i = offset; i < endbit; ++i)
-	{
-		bitmap[i/8] &= (~(1<<(i%8)));
-	}
+	int offset=(int)(bufferptr-(*pageheader).addr);
+	
+	bitmap_clear((*pageheader).bitmap, offset/GRANULE, roundsize/GRANULE);
 }
 
 // Split buffer into proper size for every request
@@ -374,6 +362,7 @@ headerList_t* splitBuffer(headerList_t* bud_list, kma_size_t bud_size){
 	tempbuffer1=(bufferNode_t*)((long int)tempbuffer0 + (*ret).size);
 	insertbuffer(ret, tempbuffer1);
 	insertbuffer(ret, tempbuffer0);
+	gStats.num_splits++;
 
 	if(bud_size < (*ret).size)
 		ret=splitBuffer(ret, bud_size);
@@ -382,14 +371,14 @@ headerList_t* splitBuffer(headerList_t* bud_list, kma_size_t bud_size){
 
 //merge the two buddy node if they are both free
 headerList_t* combi_bud(headerList_t* bud_list, kpageheader_t* bud_page){
-	if(8192==((*bud_list).size))return bud_list;
+	if(SUPERSIZE==((*bud_list).size))return bud_list;
 	
 	headerList_t* ret;
 	ret=(headerList_t*)((long int)bud_list + sizeof(headerList_t));
-	unsigned char* bitmap=(*bud_page).bitmap;
+	kma_bitmap_t* bitmap=(*bud_page).bitmap;
 	kma_size_t bud_size = (*bud_list).size;
 	
-	int i, offset, endbit;
+	int offset;
 	
 	bufferNode_t* tempbuffer0;
 	bufferNode_t* tempbuffer1;
@@ -401,15 +390,8 @@ headerList_t* combi_bud(headerList_t* bud_list, kpageheader_t* bud_page){
 		tempbuffer1=(bufferNode_t*)((void*)((*bud_list).buffer) + bud_size);
 		
 		offset += bud_size;
-		endbit = offset + bud_size;
-		offset /= 16;
-		endbit /= 16;
-
-		for( i = offset; i < endbit; ++i)
-		{
-			if(bitmap[i/8] & (1<<(i%8))){
-				return bud_list;//it is not free
-			}
+		if(!bitmap_isclear(bitmap, offset/GRANULE, bud_size/GRANULE)){
+			return bud_list;//it is not free
 		}
 		tempbuffer1=deleteBufferByNode(bud_list,tempbuffer1);
 		tempbuffer0=deleteTheFirstBufferFromFreelist(bud_list);
@@ -421,15 +403,8 @@ headerList_t* combi_bud(headerList_t* bud_list, kpageheader_t* bud_page){
 		tempbuffer1=(*bud_list).buffer;
 		
 		offset -= bud_size;
-		endbit = offset + bud_size;
-		offset /= 16;
-		endbit /= 16;
-
-		for( i = offset; i < endbit; ++i)
-		{
-			if(bitmap[i/8] & (1<<(i%8))){
-				return bud_list;//it is not free
-			}
+		if(!bitmap_isclear(bitmap, offset/GRANULE, bud_size/GRANULE)){
+			return bud_list;//it is not free
 		}
 		tempbuffer0=deleteBufferByNode(bud_list,tempbuffer0);
 		tempbuffer1=deleteTheFirstBufferFromFreelist(bud_list);
@@ -438,43 +413,53 @@ headerList_t* combi_bud(headerList_t* bud_list, kpageheader_t* bud_page){
 	//bufferNode_t* tempbuffer;
 	
 	insertbuffer(ret, tempbuffer0);
+	gStats.num_merges++;
 
-	if(bud_size < 8192)ret=combi_bud(ret, bud_page);
+	if(bud_size < SUPERSIZE)ret=combi_bud(ret, bud_page);
 	return ret;
 }
 
 // insert the free buffer to the list it belonging to
 void insertbuffer(headerList_t* thefreelist, bufferNode_t* currentBuffer){
-	bufferNode_t* temp;
-	temp=(*thefreelist).buffer;
-	(*thefreelist).buffer=currentBuffer;
+	bufferNode_t* temp=(*thefreelist).buffer;
+	
 	(*currentBuffer).nextbuffer=temp;
+	(*currentBuffer).prevbuffer=0;
+	if(temp)(*temp).prevbuffer=currentBuffer;
+	(*thefreelist).buffer=currentBuffer;
+	(*gEntry).nonempty|=1u<<ORDER(thefreelist);
 }
 
 // just delete the very first free buffer in the free list
 bufferNode_t* deleteTheFirstBufferFromFreelist(headerList_t* thefreelist){
-	bufferNode_t* ret;
-	ret=(*thefreelist).buffer;
-	(*thefreelist).buffer=(*ret).nextbuffer;
-	return (bufferNode_t*)ret;
+	return deleteBufferByNode(thefreelist, (*thefreelist).buffer);
 }
 
 // delete the buffer for a certain address
 bufferNode_t* deleteBufferByNode(headerList_t* thefreelist, bufferNode_t* node){
-	bufferNode_t* ret = 0;
-	void* tmp;
-	tmp=(*thefreelist).buffer;
-	while(tmp){
-		if((*(bufferNode_t*)tmp).nextbuffer==node){// we find it!
-			ret=node;
-			(*(bufferNode_t*)tmp).nextbuffer=(*ret).nextbuffer;
-			return ret;
-		}
-		tmp=(*(bufferNode_t*)tmp).nextbuffer;
-	}
-	return 0; // it should be free
+	if((*node).prevbuffer)(*(*node).prevbuffer).nextbuffer=(*node).nextbuffer;
+	else (*thefreelist).buffer=(*node).nextbuffer;
+	if((*node).nextbuffer)(*(*node).nextbuffer).prevbuffer=(*node).prevbuffer;
+	
+	if(!(*thefreelist).buffer)(*gEntry).nonempty&=~(1u<<ORDER(thefreelist));
+	return node;
 }
 
-
+kma_bud_stat_t*
+bud_stats()
+{
+	static kma_bud_stat_t stats;
+	int i;
+	
+	// the counters of all arenas together
+	stats=gArenaStats[0];
+	for(i=1;i<NUMARENAS;i++){
+		stats.num_splits+=gArenaStats[i].num_splits;
+		stats.num_merges+=gArenaStats[i].num_merges;
+		stats.num_lazy_frees+=gArenaStats[i].num_lazy_frees;
+		stats.num_lazy_reuses+=gArenaStats[i].num_lazy_reuses;
+	}
+	return &stats;
+}
 
 #endif // KMA_BUD
@@ -46,6 +46,8 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_bitmap.h"
+#include "kma_arena.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -54,53 +56,88 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-#define PAGENUM 91
+// every bit of a page bitmap covers 16 bytes
+#define GRANULE 16
 
-typedef struct
+// free buffers are linked both ways, so a buddy is unlinked in O(1)
+typedef struct bufferNode
 {
-	void* nextbuffer;
+	struct bufferNode* nextbuffer;
+	struct bufferNode* prevbuffer;
 } bufferNode_t;
 
+// slack = numalloc - numlocal - numglobal, that is N - 2L - G with N
+// counting the allocated and the locally free buffers
 typedef struct
 {
 	int 		size;
-	bufferNode_t* 	buffer;//point to the available one or nothing
+	bufferNode_t* 	buffer;// globally free buffers, clear in the bitmap
+	bufferNode_t*	local;// locally free buffers, still set in the bitmap
+	int		numalloc;// buffers handed out by kma_malloc
+	int		numlocal;
+	int		numglobal;
 } headerList_t;
 
 typedef struct
 {
 	kma_page_t*		ptr;// the origin res return by get page()
 	void*			addr;//the ptr.ptr, the start addr of the page
-	unsigned char	bitmap[64];// bit map, shows that the resource 
-	int				numalloc;
+	kma_bitmap_t	bitmap[BITMAP_WORDS(PAGESIZE/GRANULE)];// bit map, set for allocated and locally free buffers
+	int				numalloc;// buffers set in the bitmap
 } kpageheader_t;
 
+#define PAGENUM ((PAGESIZE - 2 * sizeof(void*)) / sizeof(kpageheader_t))
+
+// a header page describes the PAGENUM pool pages whose page_index() falls in its range
 typedef struct
 {
 	kma_page_t*		self;
 	int				numpages;// the number of page 
-	int				numalloc;// 0 means nothing//each page hold one 
-	headerList_t	freelist[10];
 	kpageheader_t	page[PAGENUM];
-	void*	nextPage;
 } pageList_t;
 
+// header pages needed to cover a pool of the given size
+#define NUMLISTS(pages) (((pages) + PAGENUM - 1) / PAGENUM)
+
+typedef struct
+{
+	kma_page_t*		self;
+	int				numpages;// the number of page 
+	int				numalloc;// 0 means nothing//each page hold one 
+	unsigned int	nonempty;// bit i is set while freelist[i] has a globally free buffer
+	headerList_t	freelist[10];
+	int				numlists;
+	pageList_t*		pagelist[];// sized from page_limit(), header page of page_index() / PAGENUM
+} mainHeader_t;
+
 /************Global Variables*********************************************/
 
-pageList_t* gEntry=0;
+// the state of every arena, gEntry and gStats are the ones the
+// calling thread works on, see kma_arena.h
+static mainHeader_t* gEntries[NUMARENAS];
+#define gEntry gEntries[kma_arena]
+
+static kma_bud_stat_t gArenaStats[NUMARENAS];
+#define gStats gArenaStats[kma_arena]
 
 /************Function Prototypes******************************************/
 
-pageList_t* initial_mainheader(kma_page_t* newpage);
+mainHeader_t* initial_mainheader();
+pageList_t* initial_pagelist(kma_page_t* newpage);
 void initial_pageheader(kpageheader_t* pageheader, kma_page_t* newpage);
-kma_size_t roundUp(kma_size_t size);
-int findFreeList(kma_size_t size);
+int findOrder(kma_size_t size);
 kpageheader_t* findFreePage();
-headerList_t* splitBuffer(headerList_t* bud_list, kma_size_t bud_size);
-headerList_t* mergeBuffer(headerList_t* bud_list, kpageheader_t* bud_page);
-void insertbuffer(headerList_t* thefreelist, bufferNode_t* thebuffer);
-bufferNode_t* deleteTheFirstBufferFromFreelist(headerList_t* thefreelist);
-bufferNode_t* deleteBufferByNode(headerList_t* thefreelist, bufferNode_t* thebufaddr);
+kpageheader_t* findPageHeader(void* addr);
+void* allocBuffer(int order);
+void freeGlobal(bufferNode_t* thebuffer, int order);
+void releasePage(kpageheader_t* thepage);
+void pushGlobal(int order, bufferNode_t* thebuffer);
+bufferNode_t* unlinkGlobal(int order, bufferNode_t* thebuffer);
+void flushLocal();
+bool isFree(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize);
+void insertbuffer(bufferNode_t** thefreelist, bufferNode_t* thebuffer);
+bufferNode_t* deleteTheFirstBufferFromFreelist(bufferNode_t** thefreelist);
+bufferNode_t* deleteBufferByNode(bufferNode_t** thefreelist, bufferNode_t* thebufaddr);
 void fillbitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize);
 void emptybitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize);
 	
@@ -115,138 +152,80 @@ kma_malloc(kma_size_t size)
 		return NULL;
 	}
 	if(!gEntry){// initialized the entry
-		gEntry=initial_mainheader(get_page());
+		gEntry=initial_mainheader();
 	}
 	
-	int roundsize=roundUp(size);
-	int i;
-	void* ret;
-
-	// if there is not enough page, we create one, the the freelist will be available
-	
-	if((i=findFreeList(size))){
-		i--;
-		headerList_t* thelist;
-		kpageheader_t* thepage=0;
-		
-		thelist = splitBuffer(&((*gEntry).freelist[i]), roundsize);
-		ret = deleteTheFirstBufferFromFreelist(thelist);
-		
-		void* theaddr;
-		theaddr=(void*)(((long int)(((long int)ret-(long int)gEntry)/PAGESIZE))*PAGESIZE+(long int)gEntry);
-		pageList_t* temppage=gEntry;
-		// find the page header
-		while(!thepage){
-			for(i = 0; i < PAGENUM; ++i)
-			{
-				if((*temppage).page[i].addr==theaddr){
-					thepage=&((*temppage).page[i]);
-					break;
-				}
-			}
-			if((*temppage).nextPage==0)break;// it should find the page
-			if(thepage)break;
-			temppage=(*temppage).nextPage;
-		}
-		fillbitmap(thepage, ret, roundsize);
-
-		(*gEntry).numalloc++;
-		(*thepage).numalloc++;
-		return (void*)ret;		
-	}
-	else{
-		kpageheader_t* newpage=findFreePage();// so we have the newpage. and it is available it freelist[9]
-		headerList_t* thelist;
-		
-		thelist=splitBuffer(&((*gEntry).freelist[9]), roundsize);
-		ret=deleteTheFirstBufferFromFreelist(thelist);
-		fillbitmap(newpage, ret, roundsize);
-
-		(*gEntry).numalloc++;
-		(*newpage).numalloc++;
-		return (void*)ret;
-	}
-  return NULL;
+	void* ret=allocBuffer(findOrder(size));
+	(*gEntry).numalloc++;
+	return ret;
 }
 
 void 
 kma_free(void* ptr, kma_size_t size)
 {
-	int roundsize=roundUp(size);
+	int order=findOrder(size);
+	headerList_t* thelist=&((*gEntry).freelist[order]);
+	int slack=(*thelist).numalloc-(*thelist).numlocal-(*thelist).numglobal;
 	
-	// find its page and its header
-	kpageheader_t* thepage=0;
-	headerList_t* thelist=0;
-	void* theaddr;
-	int i;
-	theaddr=(void*)(((long int)(((long int)ptr-(long int)gEntry)/PAGESIZE))*PAGESIZE+(long int)gEntry);
-	pageList_t* temppage=gEntry;
-	pageList_t* previouspage=0;
-	// find the page header
-	while(!thepage){
-		for(i = 0; i < PAGENUM; ++i)
-		{
-			if((*temppage).page[i].addr==theaddr){
-				thepage=&((*temppage).page[i]);
-				break;
-			}
-		}
-		if((*temppage).nextPage==0)break;// it should find the page
-		if(thepage)break;
-		previouspage=temppage;
-		temppage=(*temppage).nextPage;
-	}
-	// find the header
-	for(i = 0; i < 10; ++i)
-	{
-		if((*gEntry).freelist[i].size==roundsize){
-			break;
-		}
-	}
-	thelist=&((*gEntry).freelist[i]);
-	insertbuffer(thelist,ptr);
-	emptybitmap(thepage, ptr, roundsize);
+	(*thelist).numalloc--;
 	(*gEntry).numalloc--;
-	(*thepage).numalloc--;
-	
 	
-	headerList_t* otherlist=mergeBuffer(thelist, thepage);
-//	if((*otherlist).size==8192){//the page is empty
-	if((*thepage).numalloc==0){
-		deleteTheFirstBufferFromFreelist(otherlist);
-		free_page((*thepage).ptr);
-		(*thepage).ptr=0;
-		(*thepage).addr=0;
-		(*gEntry).numpages--;
-		(*temppage).numpages--;
+	if(slack>=2){
+	// lazy: keep the buffer marked in the bitmap and skip coalescing
+		insertbuffer(&((*thelist).local), ptr);
+		(*thelist).numlocal++;
+		gStats.num_lazy_frees++;
 	}
-	if(((*temppage).numpages==0)&&(previouspage!=0))
-	{
-		(*previouspage).nextPage=(*temppage).nextPage;
-		free_page((*temppage).self);
-	}
-	if((*gEntry).numpages==0)
-	{
-		free_page((*gEntry).self);
-		gEntry=0;
+	else{
+	// reclaiming: free it globally, accelerated: also free a local one
+		freeGlobal(ptr, order);
+		if(slack<=0 && gEntry && (*thelist).numlocal>0){
+			(*thelist).numlocal--;
+			freeGlobal(deleteTheFirstBufferFromFreelist(&((*thelist).local)), order);
+		}
 	}
 	
+	if(gEntry && (*gEntry).numalloc==0){
+		flushLocal();
+	}
 }
 
-pageList_t* initial_mainheader(kma_page_t* newpage){
-	pageList_t* ret;
+mainHeader_t* initial_mainheader(){
+	int numlists=NUMLISTS(page_limit());
+	int size=sizeof(mainHeader_t)+numlists*sizeof(pageList_t*);
+	kma_page_t* newpage=get_pages((size+PAGESIZE-1)/PAGESIZE);
+	mainHeader_t* ret;
 	
-	ret=(pageList_t*)(newpage->ptr);
+	ret=(mainHeader_t*)(newpage->ptr);
 	(*ret).self=newpage;
+	(*ret).numlists=numlists;
 	(*ret).numpages=0;
 	(*ret).numalloc=0;
-	(*ret).nextPage=0;
+	(*ret).nonempty=0;
 	int i;
 	for(i = 0; i < 10; ++i)
 	{
 		(*ret).freelist[i].size=16<<i;
 		(*ret).freelist[i].buffer=0;
+		(*ret).freelist[i].local=0;
+		(*ret).freelist[i].numalloc=0;
+		(*ret).freelist[i].numlocal=0;
+		(*ret).freelist[i].numglobal=0;
+	}
+	for(i = 0; i < numlists; ++i)
+	{
+		(*ret).pagelist[i]=0;
 	}
+	return ret;
+}
+
+pageList_t* initial_pagelist(kma_page_t* newpage){
+	pageList_t* ret;
+	
+	ret=(pageList_t*)(newpage->ptr);
+	(*ret).self=newpage;
+	(*ret).numpages=0;
+	int i;
 	for(i = 0; i < PAGENUM; ++i)
 	{
 		(*ret).page[i].ptr=0;
@@ -256,226 +235,217 @@ pageList_t* initial_mainheader(kma_page_t* newpage){
 }
 
 void initial_pageheader(kpageheader_t* pageheader, kma_page_t* newpage){
-	int j;
 	(*pageheader).ptr=newpage;
 	(*pageheader).addr=(void*)(newpage->ptr);
 	(*pageheader).numalloc=0;
-	for(j = 0; j < 64; ++j)
-	{
-		(*pageheader).bitmap[j]=0;
-	}
+	bitmap_clear((*pageheader).bitmap, 0, PAGESIZE/GRANULE);
 	// add the whole page to free list
-	*((bufferNode_t**)((*pageheader).addr))=0;
-	insertbuffer(&((*gEntry).freelist[9]), (bufferNode_t*)((*pageheader).addr));
+	pushGlobal(9, (bufferNode_t*)((*pageheader).addr));
+}
+
+int findOrder(kma_size_t size){
+	if(size<=16)return 0;
+	return 28-__builtin_clz((unsigned int)(size-1));
 }
 
-kma_size_t roundUp(kma_size_t size){
-	kma_size_t ret=16;
-	while(size>ret){
-		ret=ret<<1;
+kpageheader_t* findFreePage(){
+	kma_page_t* newpage=get_page();
+	int index=page_index(newpage->ptr);
+	pageList_t* temppage=(*gEntry).pagelist[index/PAGENUM];
+	kpageheader_t* ret;
+	
+	// the first page of a range brings its header page
+	if(!temppage){
+		temppage=initial_pagelist(get_page());
+		(*gEntry).pagelist[index/PAGENUM]=temppage;
 	}
+	ret=&((*temppage).page[index%PAGENUM]);
+	initial_pageheader(ret, newpage);
+	(*gEntry).numpages++;
+	(*temppage).numpages++;
+	
 	return ret;
 }
 
-int findFreeList(kma_size_t size){
-
-	int i;
-	int roundsize=roundUp(size);
-	for(i = 0; i < 10; ++i)
-	{
-		if((*gEntry).freelist[i].size>=roundsize){
-			if((*gEntry).freelist[i].buffer!=0)return i+1;
-		}
-	}
-	return 0;
+// the header of a page sits at a fixed slot given by its pool index
+kpageheader_t* findPageHeader(void* addr){
+	int index=page_index(addr);
+	
+	return &((*(*gEntry).pagelist[index/PAGENUM]).page[index%PAGENUM]);
 }
 
-kpageheader_t* findFreePage(){
-	kpageheader_t* ret=0;
-	pageList_t* temppage=gEntry;
+// take a buffer of the given order, locally free ones first
+void* allocBuffer(int order){
+	headerList_t* thelist=&((*gEntry).freelist[order]);
+	bufferNode_t* ret;
+	unsigned int avail;
 	int i;
 	
-	// find the available page header
-	while(!ret){
-		for(i = 0; i < PAGENUM; ++i)
-		{
-			if((*temppage).page[i].ptr==0){
-				ret=&((*temppage).page[i]);
-				break;
-			}
-		}
-		if((*temppage).nextPage==0)break;
-		if(ret)break;
-		temppage=(*temppage).nextPage;
+	(*thelist).numalloc++;
+	if((*thelist).local){
+	// still marked in the bitmap, nothing else to do
+		(*thelist).numlocal--;
+		gStats.num_lazy_reuses++;
+		return deleteTheFirstBufferFromFreelist(&((*thelist).local));
 	}
-	// if finding a page, then init it
-	if(ret!=0)
-	{
-		initial_pageheader(ret, get_page());
-		(*gEntry).numpages++;
-		(*temppage).numpages++;
+	
+	// the lowest order with a globally free buffer that is large enough
+	avail=(*gEntry).nonempty&(~0u<<order);
+	if(avail){
+		i=__builtin_ctz(avail);
 	}
-	// If there is no page yet, then create the header and page.
 	else{
-		(*temppage).nextPage=initial_mainheader(get_page());
-		temppage=(*temppage).nextPage;
-		ret=&((*temppage).page[0]);
-		initial_pageheader(ret, get_page());
-		(*gEntry).numpages++;
-		(*temppage).numpages++;
+		findFreePage();
+		i=9;
+	}
+	// split down to the requested order, keeping the lower half
+	ret=unlinkGlobal(i, (*gEntry).freelist[i].buffer);
+	while(i>order){
+		i--;
+		pushGlobal(i, (bufferNode_t*)((void*)ret+(*gEntry).freelist[i].size));
+		gStats.num_splits++;
 	}
 	
+	kpageheader_t* thepage=findPageHeader(ret);
+	fillbitmap(thepage, ret, (*thelist).size);
+	(*thepage).numalloc++;
 	return ret;
 }
 
-//create the bitmap for storing the free states of buddy lists.
-void fillbitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
-	unsigned char* bitmap=(*pageheader).bitmap;
-	int i, offset, endbit;
-	offset=(int)(bufferptr-(*pageheader).addr);
-	endbit = offset + roundsize;
-	offset /= 16;
-	endbit /= 16;
+// clear the buffer in the bitmap and coalesce it with its free buddies
+void freeGlobal(bufferNode_t* thebuffer, int order){
+	kpageheader_t* thepage=findPageHeader(thebuffer);
+	kma_size_t bud_size=(*gEntry).freelist[order].size;
 	
-	for( i = offset; i < endbit; ++i)
-	{
-		bitmap[i/8] |= (1<<(i%8));
+	emptybitmap(thepage, thebuffer, bud_size);
+	(*thepage).numalloc--;
+	
+	while(order<9){
+		int offset=(int)((void*)thebuffer-(*thepage).addr);
+		bufferNode_t* buddy=(bufferNode_t*)((*thepage).addr+(offset^bud_size));
+		
+		if(!isFree(thepage, buddy, bud_size))break;
+		unlinkGlobal(order, buddy);
+		gStats.num_merges++;
+		if(buddy<thebuffer)thebuffer=buddy;
+		order++;
+		bud_size<<=1;
+	}
+	pushGlobal(order, thebuffer);
+	
+	if((*thepage).numalloc==0){
+		releasePage(thepage);
 	}
 }
 
-// clear the bitmap
-void emptybitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
-	unsigned char* bitmap=(*pageheader).bitmap;
-	int i, offset, endbit;
-	offset=(int)(bufferptr-(*pageheader).addr);
-	endbit = offset + roundsize;
-	offset /= 16;
-	endbit /= 16;
-	for( i = offset; i < endbit; ++i)
+// give a fully coalesced page back
+void releasePage(kpageheader_t* thepage){
+	int index=page_index((*thepage).addr);
+	pageList_t* owner=(*gEntry).pagelist[index/PAGENUM];
+	
+	unlinkGlobal(9, (*thepage).addr);
+	free_page((*thepage).ptr);
+	(*thepage).ptr=0;
+	(*thepage).addr=0;
+	(*gEntry).numpages--;
+	(*owner).numpages--;
+	
+	if((*owner).numpages==0)
+	{
+		(*gEntry).pagelist[index/PAGENUM]=0;
+		free_page((*owner).self);
+	}
+	if((*gEntry).numpages==0)
 	{
-		bitmap[i/8] &= (~(1<<(i%8)));
+		free_pages((*gEntry).self);
+		gEntry=0;
 	}
 }
 
-// Split buffer into proper size for every request
-headerList_t* splitBuffer(headerList_t* bud_list, kma_size_t bud_size){
+// put a buffer on the global list of its order
+void pushGlobal(int order, bufferNode_t* thebuffer){
+	insertbuffer(&((*gEntry).freelist[order].buffer), thebuffer);
+	(*gEntry).freelist[order].numglobal++;
+	(*gEntry).nonempty|=1u<<order;
+}
 
-	if(bud_size==((*bud_list).size))return bud_list;
-	
-	headerList_t* ret;
-	ret=(headerList_t*)((long int)bud_list-sizeof(headerList_t));
-	
-	bufferNode_t* tempbuffer;
-	bufferNode_t* tempbuffer0;
-	bufferNode_t* tempbuffer1;	
-	// dealing with the large block free list
-	tempbuffer=deleteTheFirstBufferFromFreelist(bud_list);
-	// dealing with the small block free list
-	tempbuffer0=tempbuffer;
-	tempbuffer1=(bufferNode_t*)((long int)tempbuffer0 + (*ret).size);
-	insertbuffer(ret, tempbuffer1);
-	insertbuffer(ret, tempbuffer0);
-
-	if(bud_size < (*ret).size)
-		ret=splitBuffer(ret, bud_size);
-	return ret;
+// take a buffer off the global list of its order
+bufferNode_t* unlinkGlobal(int order, bufferNode_t* thebuffer){
+	deleteBufferByNode(&((*gEntry).freelist[order].buffer), thebuffer);
+	(*gEntry).freelist[order].numglobal--;
+	if(!(*gEntry).freelist[order].buffer)(*gEntry).nonempty&=~(1u<<order);
+	return thebuffer;
 }
 
-//merge the two buddy node if they are both free
-headerList_t* mergeBuffer(headerList_t* bud_list, kpageheader_t* bud_page){
-	if(8192==((*bud_list).size))return bud_list;
-	
-	headerList_t* ret;
-	ret=(headerList_t*)((long int)bud_list + sizeof(headerList_t));
-	unsigned char* bitmap=(*bud_page).bitmap;
-	kma_size_t bud_size = (*bud_list).size;
-	
-	int i, offset, endbit;
-	
-	bufferNode_t* tempbuffer0;
-	bufferNode_t* tempbuffer1;
-	offset=(int)((void*)((*bud_list).buffer)-(void*)((*bud_page).addr));
-	
-	if(offset%(bud_size*2)==0){
-	// the next one is the buddy
-		tempbuffer0=(*bud_list).buffer;
-		tempbuffer1=(bufferNode_t*)((void*)((*bud_list).buffer) + bud_size);
-		
-		offset += bud_size;
-		endbit = offset + bud_size;
-		offset /= 16;
-		endbit /= 16;
-
-		for( i = offset; i < endbit; ++i)
-		{
-			if(bitmap[i/8] & (1<<(i%8))){
-				return bud_list;//it is not free
-			}
+// nothing is allocated anymore, coalesce every locally free buffer
+void flushLocal(){
+	int i;
+	for(i = 0; i < 10 && gEntry; ++i)
+	{
+		while(gEntry && (*gEntry).freelist[i].local){
+			(*gEntry).freelist[i].numlocal--;
+			freeGlobal(deleteTheFirstBufferFromFreelist(&((*gEntry).freelist[i].local)), i);
 		}
-		tempbuffer1=deleteBufferByNode(bud_list,tempbuffer1);
-		tempbuffer0=deleteTheFirstBufferFromFreelist(bud_list);
 	}
-	else{
-	// the pevirous one it the buddy
+}
+
+// check whether no granule of the buffer is set in the bitmap
+bool isFree(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
+	int offset=(int)(bufferptr-(*pageheader).addr);
 	
-		tempbuffer0=(bufferNode_t*)((void*)((*bud_list).buffer) - bud_size);
-		tempbuffer1=(*bud_list).buffer;
-		
-		offset -= bud_size;
-		endbit = offset + bud_size;
-		offset /= 16;
-		endbit /= 16;
-
-		for( i = offset; i < endbit; ++i)
-		{
-			if(bitmap[i/8] & (1<<(i%8))){
-				return bud_list;//it is not free
-			}
-		}
-		tempbuffer0=deleteBufferByNode(bud_list,tempbuffer0);
-		tempbuffer1=deleteTheFirstBufferFromFreelist(bud_list);
-	}
-	// now the buddy is free, we need to combine them
-	//bufferNode_t* tempbuffer;
+	return bitmap_isclear((*pageheader).bitmap, offset/GRANULE, roundsize/GRANULE);
+}
+
+//create the bitmap for storing the free states of buddy lists.
+void fillbitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
+	int offset=(int)(bufferptr-(*pageheader).addr);
 	
-	insertbuffer(ret, tempbuffer0);
+	bitmap_set((*pageheader).bitmap, offset/GRANULE, roundsize/GRANULE);
+}
 
-	if(bud_size < 8192)ret=mergeBuffer(ret, bud_page);
-	return ret;
+// clear the bitmap
+void emptybitmap(kpageheader_t* pageheader, void* bufferptr, kma_size_t roundsize){
+	int offset=(int)(bufferptr-(*pageheader).addr);
+	
+	bitmap_clear((*pageheader).bitmap, offset/GRANULE, roundsize/GRANULE);
 }
 
 // insert the free buffer to the list it belonging to
-void insertbuffer(headerList_t* thefreelist, bufferNode_t* currentBuffer){
-	bufferNode_t* temp;
-	temp=(*thefreelist).buffer;
-	(*thefreelist).buffer=currentBuffer;
-	(*currentBuffer).nextbuffer=temp;
+void insertbuffer(bufferNode_t** thefreelist, bufferNode_t* currentBuffer){
+	(*currentBuffer).nextbuffer=*thefreelist;
+	(*currentBuffer).prevbuffer=0;
+	if(*thefreelist)(**thefreelist).prevbuffer=currentBuffer;
+	*thefreelist=currentBuffer;
 }
 
 // just delete the very first free buffer in the free list
-bufferNode_t* deleteTheFirstBufferFromFreelist(headerList_t* thefreelist){
-	bufferNode_t* ret;
-	ret=(*thefreelist).buffer;
-	(*thefreelist).buffer=(*ret).nextbuffer;
-	return (bufferNode_t*)ret;
+bufferNode_t* deleteTheFirstBufferFromFreelist(bufferNode_t** thefreelist){
+	return deleteBufferByNode(thefreelist, *thefreelist);
 }
 
 // delete the buffer for a certain address
-bufferNode_t* deleteBufferByNode(headerList_t* thefreelist, bufferNode_t* node){
-	bufferNode_t* ret = 0;
-	void* tmp;
-	tmp=(*thefreelist).buffer;
-	while(tmp){
-		if((*(bufferNode_t*)tmp).nextbuffer==node){// we find it!
-			ret=node;
-			(*(bufferNode_t*)tmp).nextbuffer=(*ret).nextbuffer;
-			return ret;
-		}
-		tmp=(*(bufferNode_t*)tmp).nextbuffer;
-	}
-	return 0; // it should be free
+bufferNode_t* deleteBufferByNode(bufferNode_t** thefreelist, bufferNode_t* node){
+	if((*node).prevbuffer)(*(*node).prevbuffer).nextbuffer=(*node).nextbuffer;
+	else *thefreelist=(*node).nextbuffer;
+	if((*node).nextbuffer)(*(*node).nextbuffer).prevbuffer=(*node).prevbuffer;
+	return node;
 }
 
-
+kma_bud_stat_t*
+bud_stats()
+{
+	static kma_bud_stat_t stats;
+	int i;
+	
+	// the counters of all arenas together
+	stats=gArenaStats[0];
+	for(i=1;i<NUMARENAS;i++){
+		stats.num_splits+=gArenaStats[i].num_splits;
+		stats.num_merges+=gArenaStats[i].num_merges;
+		stats.num_lazy_frees+=gArenaStats[i].num_lazy_frees;
+		stats.num_lazy_reuses+=gArenaStats[i].num_lazy_reuses;
+	}
+	return &stats;
+}
 
 #endif // KMA_LZBUD
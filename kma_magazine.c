@@ -0,0 +1,474 @@
+/***************************************************************************
+ *  Title: Magazines
+ * -------------------------------------------------------------------------
+ *    Purpose: Per thread magazines of buffers with a shared depot in
+ *             front of the power-of-two engines
+ ***************************************************************************/
+#ifdef KMA_MAGAZINE
+#define __KMAGAZINE_IMPL__
+
+#if !defined(KMA_BUD) && !defined(KMA_P2FL) && !defined(KMA_MCK2)
+#error "KMA_MAGAZINE needs KMA_BUD, KMA_P2FL or KMA_MCK2"
+#endif
+
+/************System include***********************************************/
+#include <string.h>
+#ifdef KMA_CONCURRENT
+#include <pthread.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_magazine.h"
+#include "kma_arena.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// requests up to the largest class go through the magazines, a class
+// is served with buffers of its full size so any request of the class
+// can reuse any of its buffers
+#define MAGCLASSES 8
+#define MINCLASS 16
+
+// P2FL keeps a word in front of every buffer, so its classes hold a
+// word less than a power of two
+#ifdef KMA_P2FL
+#define MAGHEADER ((int)sizeof(void*))
+#else
+#define MAGHEADER 0
+#endif
+#define CLASSSIZE(class) ((MINCLASS << (class)) - MAGHEADER)
+
+// magazines start with MAGROUNDS rounds, a class gets larger ones each
+// time its depot is found busy, up to MAGMAXROUNDS
+#ifndef MAGROUNDS
+#define MAGROUNDS 16
+#endif
+#ifndef MAGMAXROUNDS
+#define MAGMAXROUNDS 128
+#endif
+
+// full magazines the depot keeps per class, the buffers of any more go
+// back to the engine
+#ifndef DEPOTFULL
+#define DEPOTFULL 8
+#endif
+
+// the layer below is the arenas in the concurrent build
+#ifdef KMA_CONCURRENT
+#define LOWERMALLOC arena_malloc
+#define LOWERFREE arena_free
+#define DEPOTUNLOCK(class) pthread_mutex_unlock(&gDepot[class].lock)
+#define COUNT(field, n) \
+  __atomic_add_fetch(&gMagStats.field, (n), __ATOMIC_RELAXED)
+#else
+#define LOWERMALLOC engine_malloc
+#define LOWERFREE engine_free
+#define DEPOTUNLOCK(class)
+#define COUNT(field, n) (gMagStats.field += (n))
+#endif
+
+typedef struct magazine
+{
+  struct magazine*  next;    // the next magazine in a depot list
+  int               size;    // rounds the magazine holds
+  int               rounds;  // rounds loaded
+  void*             round[];
+} magazine_t;
+
+#define MAGBYTES(size) ((int)(sizeof(magazine_t) + (size) * sizeof(void*)))
+
+// the full and empty magazines of a class that no thread holds
+typedef struct
+{
+#ifdef KMA_CONCURRENT
+  pthread_mutex_t  lock;
+#endif
+  magazine_t*      full;
+  magazine_t*      empty;
+  int              numfull;
+  int              size;     // rounds of new magazines
+} depot_t;
+
+/************Global Variables*********************************************/
+
+// every thread loads rounds from and into gLoaded and keeps gPrevious
+// to swap with, neither is shared with other threads
+static __thread magazine_t* gLoaded[MAGCLASSES];
+static __thread magazine_t* gPrevious[MAGCLASSES];
+
+static depot_t gDepot[MAGCLASSES] =
+  {
+#ifdef KMA_CONCURRENT
+    [0 ... MAGCLASSES - 1] =
+      { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, MAGROUNDS }
+#else
+    [0 ... MAGCLASSES - 1] = { NULL, NULL, 0, MAGROUNDS }
+#endif
+  };
+
+static kma_magazine_stat_t gMagStats = { 0, 0, 0, MAGROUNDS };
+
+#ifdef KMA_CONCURRENT
+// gives the magazines of a thread back when it exits
+static pthread_key_t gThreadKey;
+static pthread_once_t gThreadOnce = PTHREAD_ONCE_INIT;
+static __thread bool gThreadHooked = FALSE;
+// set once the key gave the magazines back, the destructors of other
+// keys may still call in after that, and then go to the engine
+static __thread bool gThreadExited = FALSE;
+#endif
+
+/************Function Prototypes******************************************/
+static int findClass(kma_size_t size);
+static bool reloadFull(int class);
+static bool reloadEmpty(int class);
+static void depotLock(int class);
+static void drainMagazine(int class, magazine_t* mag);
+static void releaseThread();
+#ifdef KMA_CONCURRENT
+static void hookThread();
+static void threadExit(void* arg);
+static void makeThreadKey();
+#endif
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int class = findClass(size);
+  magazine_t* mag;
+
+  if (class < 0)
+    {
+      return LOWERMALLOC(size);
+    }
+
+  // a round from the loaded magazine, without any synchronization
+  mag = gLoaded[class];
+  if (mag != NULL && mag->rounds > 0)
+    {
+      return mag->round[--mag->rounds];
+    }
+
+  if (reloadFull(class))
+    {
+      mag = gLoaded[class];
+      return mag->round[--mag->rounds];
+    }
+
+  COUNT(num_backend, 1);
+  return LOWERMALLOC(CLASSSIZE(class));
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  int class = findClass(size);
+  magazine_t* mag;
+
+  if (class < 0)
+    {
+      LOWERFREE(ptr, size);
+      return;
+    }
+
+  mag = gLoaded[class];
+  if (mag != NULL && mag->rounds < mag->size)
+    {
+      mag->round[mag->rounds++] = ptr;
+      return;
+    }
+
+  if (reloadEmpty(class))
+    {
+      mag = gLoaded[class];
+      mag->round[mag->rounds++] = ptr;
+      return;
+    }
+
+  COUNT(num_backend, 1);
+  LOWERFREE(ptr, CLASSSIZE(class));
+}
+
+void
+kma_magazine_reap()
+{
+  int class;
+
+  releaseThread();
+
+  for (class = 0; class < MAGCLASSES; class++)
+    {
+      magazine_t* full;
+      magazine_t* empty;
+      magazine_t* next;
+
+      depotLock(class);
+      full = gDepot[class].full;
+      empty = gDepot[class].empty;
+      gDepot[class].full = NULL;
+      gDepot[class].empty = NULL;
+      gDepot[class].numfull = 0;
+      DEPOTUNLOCK(class);
+
+      for (; full != NULL; full = next)
+	{
+	  next = full->next;
+	  drainMagazine(class, full);
+	  LOWERFREE(full, MAGBYTES(full->size));
+	}
+      for (; empty != NULL; empty = next)
+	{
+	  next = empty->next;
+	  LOWERFREE(empty, MAGBYTES(empty->size));
+	}
+    }
+}
+
+kma_magazine_stat_t*
+magazine_stats()
+{
+  static kma_magazine_stat_t stats;
+  int class;
+
+  stats.num_backend = COUNT(num_backend, 0);
+  stats.num_exchanges = COUNT(num_exchanges, 0);
+  stats.num_contended = COUNT(num_contended, 0);
+  stats.max_rounds = MAGROUNDS;
+  for (class = 0; class < MAGCLASSES; class++)
+    {
+      depotLock(class);
+      if (gDepot[class].size > stats.max_rounds)
+	{
+	  stats.max_rounds = gDepot[class].size;
+	}
+      DEPOTUNLOCK(class);
+    }
+
+  return &stats;
+}
+
+// the class of a request, or -1 if it is too large for the magazines
+static int
+findClass(kma_size_t size)
+{
+  int class = 0;
+
+  while (class < MAGCLASSES && CLASSSIZE(class) < size)
+    {
+      class++;
+    }
+
+  return class < MAGCLASSES ? class : -1;
+}
+
+// load a magazine with rounds, the previous one if it has any or a full
+// one from the depot, for which the empty previous one is given back
+static bool
+reloadFull(int class)
+{
+  magazine_t* prev = gPrevious[class];
+  magazine_t* full;
+
+  if (prev != NULL && prev->rounds > 0)
+    {
+      gPrevious[class] = gLoaded[class];
+      gLoaded[class] = prev;
+      return TRUE;
+    }
+
+#ifdef KMA_CONCURRENT
+  if (gThreadExited)
+    {
+      return FALSE;
+    }
+  hookThread();
+#endif
+
+  depotLock(class);
+  full = gDepot[class].full;
+  if (full != NULL)
+    {
+      gDepot[class].full = full->next;
+      gDepot[class].numfull--;
+      if (prev != NULL)
+	{
+	  prev->next = gDepot[class].empty;
+	  gDepot[class].empty = prev;
+	}
+      gPrevious[class] = gLoaded[class];
+      gLoaded[class] = full;
+    }
+  DEPOTUNLOCK(class);
+
+  if (full == NULL)
+    {
+      return FALSE;
+    }
+
+  COUNT(num_exchanges, 1);
+  return TRUE;
+}
+
+// load a magazine with room, the previous one if it has any or an empty
+// one from the depot or the engine, for which the full previous one is
+// given to the depot. A depot with DEPOTFULL full magazines gets none,
+// the buffers of the previous one go back to the engine instead
+static bool
+reloadEmpty(int class)
+{
+  magazine_t* prev = gPrevious[class];
+  magazine_t* empty = NULL;
+  int size;
+
+  if (prev != NULL && prev->rounds < prev->size)
+    {
+      gPrevious[class] = gLoaded[class];
+      gLoaded[class] = prev;
+      return TRUE;
+    }
+
+#ifdef KMA_CONCURRENT
+  if (gThreadExited)
+    {
+      return FALSE;
+    }
+  hookThread();
+#endif
+
+  depotLock(class);
+  if (prev != NULL && gDepot[class].numfull < DEPOTFULL)
+    {
+      prev->next = gDepot[class].full;
+      gDepot[class].full = prev;
+      gDepot[class].numfull++;
+      prev = NULL;
+    }
+  if (prev == NULL && gDepot[class].empty != NULL)
+    {
+      empty = gDepot[class].empty;
+      gDepot[class].empty = empty->next;
+    }
+  size = gDepot[class].size;
+  DEPOTUNLOCK(class);
+  COUNT(num_exchanges, 1);
+
+  // magazines from before the class grew are replaced
+  if (empty != NULL && empty->size < size)
+    {
+      LOWERFREE(empty, MAGBYTES(empty->size));
+      empty = NULL;
+    }
+
+  if (prev != NULL)
+    {
+      drainMagazine(class, prev);
+      empty = prev;
+    }
+  else if (empty == NULL)
+    {
+      empty = LOWERMALLOC(MAGBYTES(size));
+      if (empty != NULL)
+	{
+	  empty->size = size;
+	  empty->rounds = 0;
+	}
+    }
+
+  gPrevious[class] = gLoaded[class];
+  gLoaded[class] = empty;
+
+  return empty != NULL;
+}
+
+// lock the depot of a class, a busy one makes its magazines larger
+static void
+depotLock(int class)
+{
+#ifdef KMA_CONCURRENT
+  if (pthread_mutex_trylock(&gDepot[class].lock) == 0)
+    {
+      return;
+    }
+
+  pthread_mutex_lock(&gDepot[class].lock);
+  if (gDepot[class].size < MAGMAXROUNDS)
+    {
+      gDepot[class].size++;
+    }
+  COUNT(num_contended, 1);
+#endif
+}
+
+// give the rounds of a magazine back to the engine
+static void
+drainMagazine(int class, magazine_t* mag)
+{
+  COUNT(num_backend, mag->rounds);
+  while (mag->rounds > 0)
+    {
+      LOWERFREE(mag->round[--mag->rounds], CLASSSIZE(class));
+    }
+}
+
+// give the magazines of the calling thread and their rounds back
+static void
+releaseThread()
+{
+  int class;
+
+  for (class = 0; class < MAGCLASSES; class++)
+    {
+      magazine_t* mags[2] = { gLoaded[class], gPrevious[class] };
+      int i;
+
+      for (i = 0; i < 2; i++)
+	{
+	  if (mags[i] != NULL)
+	    {
+	      drainMagazine(class, mags[i]);
+	      LOWERFREE(mags[i], MAGBYTES(mags[i]->size));
+	    }
+	}
+      gLoaded[class] = NULL;
+      gPrevious[class] = NULL;
+    }
+}
+
+#ifdef KMA_CONCURRENT
+static void
+hookThread()
+{
+  if (gThreadHooked)
+    {
+      return;
+    }
+
+  pthread_once(&gThreadOnce, makeThreadKey);
+  pthread_setspecific(gThreadKey, gLoaded);
+  gThreadHooked = TRUE;
+}
+
+static void
+threadExit(void* arg)
+{
+  releaseThread();
+  gThreadExited = TRUE;
+}
+
+static void
+makeThreadKey()
+{
+  pthread_key_create(&gThreadKey, threadExit);
+}
+#endif
+
+#endif // KMA_MAGAZINE
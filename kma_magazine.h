@@ -0,0 +1,67 @@
+/***************************************************************************
+ *  Title: Magazines
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the per thread object magazines in front of
+ *             the power-of-two engines
+ ***************************************************************************/
+
+#ifndef __KMAGAZINE_H__
+#define __KMAGAZINE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KMAGAZINE_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+typedef struct
+{
+  int num_backend;     // buffers taken from and given back to the engine
+  int num_exchanges;   // magazines taken from and given back to the depot
+  int num_contended;   // times the depot of a class was busy
+  int max_rounds;      // the largest magazine size reached by any class
+} kma_magazine_stat_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Reaps the magazines
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives the buffers in the magazines of the calling thread
+ *             and in the depot back to the engine, along with the
+ *             magazines themselves
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_magazine_reap();
+
+/***********************************************************************
+ *  Title: Magazine statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get how often the magazines had to go to the depot or to
+ *             the engine and how large they grew
+ *    Input: none
+ *    Output: the magazine statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_magazine_stat_t* magazine_stats();
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMAGAZINE_H__ */
@@ -38,10 +38,12 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_arena.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -50,10 +52,70 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// blocks carry no header, the smallest one must hold a free list node
+#define MINBLKSIZE 16
+#define NUMCLASSES 9
+#define MAXBLKSIZE (MINBLKSIZE << (NUMCLASSES - 1))
+
+// class of pages holding a single block larger than MAXBLKSIZE
+#define LARGECLASS NUMCLASSES
+
+// free blocks of a class are linked through their first two words
+typedef struct freeblk
+{
+  struct freeblk*  next;
+  struct freeblk*  prev;
+} freeblk_t;
+
+// one entry per pool page, like kmemsizes[] in 4.4BSD
+typedef struct
+{
+  kma_page_t*  page;     // descriptor of a data page, NULL if not ours
+  short        class;    // size class the page is carved into
+  short        numalloc; // blocks of the page in use
+} kmemsize_t;
+
+#define SIZESPERCHUNK (PAGESIZE / sizeof(kmemsize_t))
+
+// chunks needed to cover a pool of the given size
+#define NUMCHUNKS(pages) (((pages) + SIZESPERCHUNK - 1) / SIZESPERCHUNK)
+
+// a page holding kmemsizes entries
+typedef struct
+{
+  kma_page_t*  page;
+  int          numpages; // data pages described by the chunk
+} kmemchunk_t;
+
+// control page, the kmemsizes table lives in chunks allocated on demand
+typedef struct
+{
+  kma_page_t*  self;
+  int          numpages;               // data pages in use
+  int          numalloc;               // blocks in use
+  freeblk_t*   freelist[NUMCLASSES];   // free blocks of each class
+  int          spare[NUMCLASSES];      // empty page kept per class, or -1
+  int          numchunks;
+  kmemchunk_t  chunk[];                // sized from page_limit()
+} kmemctl_t;
+
 /************Global Variables*********************************************/
 
+// one control structure per arena, gKmem is the calling thread's
+static kmemctl_t* gKmems[NUMARENAS];
+#define gKmem gKmems[kma_arena]
+
 /************Function Prototypes******************************************/
 
+static void initControl();
+static kmemsize_t* sizeEntry(int index, bool create);
+static int findClass(kma_size_t size);
+static void carvePage(int class);
+static void pushBlock(int class, freeblk_t* blk);
+static void unlinkBlock(int class, freeblk_t* blk);
+static void releasePage(int index);
+static void releaseSpares();
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -61,13 +123,259 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  kmemsize_t* entry;
+  freeblk_t* blk;
+  int class;
+  int index;
+  
+  if ((size + sizeof(void*)) > PAGESIZE)
+    { // requested size too large
+      return NULL;
+    }
+  
+  if (gKmem == NULL)
+    {
+      initControl();
+    }
+  
+  if (size > MAXBLKSIZE)
+    {
+      kma_page_t* page = get_page();
+      
+      entry = sizeEntry(page_index(page->ptr), TRUE);
+      entry->page = page;
+      entry->class = LARGECLASS;
+      entry->numalloc = 1;
+      gKmem->numpages++;
+      gKmem->numalloc++;
+      return page->ptr;
+    }
+  
+  class = findClass(size);
+  if (gKmem->freelist[class] == NULL)
+    {
+      carvePage(class);
+    }
+  
+  blk = gKmem->freelist[class];
+  unlinkBlock(class, blk);
+  
+  index = page_index(blk);
+  entry = sizeEntry(index, FALSE);
+  if (entry->numalloc == 0 && gKmem->spare[class] == index)
+    { // the kept empty page is in use again
+      gKmem->spare[class] = -1;
+    }
+  entry->numalloc++;
+  gKmem->numalloc++;
+  
+  return (void*)blk;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  int index = page_index(ptr);
+  kmemsize_t* entry = sizeEntry(index, FALSE);
+  int class = entry->class;
+  
+  assert(entry->page != NULL && entry->numalloc > 0);
+  
+  gKmem->numalloc--;
+  entry->numalloc--;
+  
+  if (class == LARGECLASS)
+    {
+      releasePage(index);
+    }
+  else
+    {
+      pushBlock(class, (freeblk_t*)ptr);
+      if (entry->numalloc == 0)
+	{
+	  if (gKmem->spare[class] == -1)
+	    {
+	      gKmem->spare[class] = index;
+	    }
+	  else
+	    {
+	      releasePage(index);
+	    }
+	}
+    }
+  
+  if (gKmem != NULL && gKmem->numalloc == 0)
+    {
+      releaseSpares();
+    }
+}
+
+// set up the control page
+static void
+initControl()
+{
+  int numchunks = NUMCHUNKS(page_limit());
+  int size = sizeof(kmemctl_t) + numchunks * sizeof(kmemchunk_t);
+  kma_page_t* page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+  int i;
+  
+  gKmem = (kmemctl_t*)page->ptr;
+  gKmem->self = page;
+  gKmem->numpages = 0;
+  gKmem->numalloc = 0;
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      gKmem->freelist[i] = NULL;
+      gKmem->spare[i] = -1;
+    }
+  gKmem->numchunks = numchunks;
+  for (i = 0; i < numchunks; i++)
+    {
+      gKmem->chunk[i].page = NULL;
+      gKmem->chunk[i].numpages = 0;
+    }
+}
+
+// find the kmemsizes entry of a page, optionally allocating its chunk
+static kmemsize_t*
+sizeEntry(int index, bool create)
+{
+  int chunk = index / SIZESPERCHUNK;
+  
+  assert(chunk < gKmem->numchunks);
+  
+  if (gKmem->chunk[chunk].page == NULL)
+    {
+      assert(create);
+      gKmem->chunk[chunk].page = get_page();
+      memset(gKmem->chunk[chunk].page->ptr, 0, PAGESIZE);
+    }
+  if (create)
+    {
+      gKmem->chunk[chunk].numpages++;
+    }
+  
+  return ((kmemsize_t*)gKmem->chunk[chunk].page->ptr) + (index % SIZESPERCHUNK);
+}
+
+// map a request to the smallest class holding it
+static int
+findClass(kma_size_t size)
+{
+  int i = 0;
+  kma_size_t blksize = MINBLKSIZE;
+  
+  while (blksize < size)
+    {
+      blksize <<= 1;
+      i++;
+    }
+  return i;
+}
+
+// get a page, record its class and put all of its blocks on the free list
+static void
+carvePage(int class)
+{
+  kma_page_t* page = get_page();
+  kmemsize_t* entry = sizeEntry(page_index(page->ptr), TRUE);
+  int blksize = MINBLKSIZE << class;
+  int offset;
+  
+  entry->page = page;
+  entry->class = class;
+  entry->numalloc = 0;
+  gKmem->numpages++;
+  
+  // push in reverse so blocks are handed out in address order
+  for (offset = PAGESIZE - blksize; offset >= 0; offset -= blksize)
+    {
+      pushBlock(class, (freeblk_t*)(page->ptr + offset));
+    }
+}
+
+static void
+pushBlock(int class, freeblk_t* blk)
+{
+  blk->prev = NULL;
+  blk->next = gKmem->freelist[class];
+  if (blk->next != NULL)
+    {
+      blk->next->prev = blk;
+    }
+  gKmem->freelist[class] = blk;
+}
+
+static void
+unlinkBlock(int class, freeblk_t* blk)
+{
+  if (blk->prev != NULL)
+    {
+      blk->prev->next = blk->next;
+    }
+  else
+    {
+      gKmem->freelist[class] = blk->next;
+    }
+  if (blk->next != NULL)
+    {
+      blk->next->prev = blk->prev;
+    }
+}
+
+// give an empty page back, tearing down the control page with the last one
+static void
+releasePage(int index)
+{
+  kmemsize_t* entry = sizeEntry(index, FALSE);
+  int chunk = index / SIZESPERCHUNK;
+  
+  assert(entry->numalloc == 0);
+  
+  if (entry->class != LARGECLASS)
+    {
+      int blksize = MINBLKSIZE << entry->class;
+      int offset;
+      
+      for (offset = 0; offset < PAGESIZE; offset += blksize)
+	{
+	  unlinkBlock(entry->class, (freeblk_t*)(entry->page->ptr + offset));
+	}
+    }
+  
+  free_page(entry->page);
+  entry->page = NULL;
+  gKmem->numpages--;
+  
+  if (--gKmem->chunk[chunk].numpages == 0)
+    {
+      free_page(gKmem->chunk[chunk].page);
+      gKmem->chunk[chunk].page = NULL;
+    }
+  
+  if (gKmem->numpages == 0)
+    {
+      free_pages(gKmem->self);
+      gKmem = NULL;
+    }
+}
+
+// release the kept empty pages once nothing is allocated anymore
+static void
+releaseSpares()
+{
+  int i;
+  
+  for (i = 0; i < NUMCLASSES && gKmem != NULL; i++)
+    {
+      if (gKmem->spare[i] != -1)
+	{
+	  int index = gKmem->spare[i];
+	  
+	  gKmem->spare[i] = -1;
+	  releasePage(index);
+	}
+    }
 }
 
 #endif // KMA_MCK2
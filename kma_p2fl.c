@@ -42,6 +42,7 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_arena.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -50,10 +51,47 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// buffer sizes include the one word header in front of the user data
+#define MINBUFSIZE 16
+#define NUMCLASSES 8
+#define MAXBUFSIZE (MINBUFSIZE << (NUMCLASSES - 1))
+
+// pages carved into buffers start with this header
+typedef struct p2page
+{
+  kma_page_t*     page;     // the descriptor returned by get_page()
+  struct p2page*  prev;     // neighbours in the class page list
+  struct p2page*  next;
+  void*           freebuf;  // first free buffer in this page
+  int             numalloc; // buffers handed out from this page
+} p2page_t;
+
+#define FIRSTBUF ((sizeof(p2page_t) + MINBUFSIZE - 1) & ~(MINBUFSIZE - 1))
+
+// one free list per power-of-two class
+typedef struct
+{
+  int        size;  // buffer size of this class
+  p2page_t*  pages; // pages with at least one free buffer
+  p2page_t*  spare; // one fully free page kept to absorb churn
+} freelist_t;
+
 /************Global Variables*********************************************/
 
+// one set of lists per arena, the macros pick the calling thread's
+static freelist_t gFreelists[NUMARENAS][NUMCLASSES];
+static int gNumAllocs[NUMARENAS];
+#define gFreelist gFreelists[kma_arena]
+#define gNumAlloc gNumAllocs[kma_arena]
+
 /************Function Prototypes******************************************/
 
+static int findClass(kma_size_t size);
+static p2page_t* initPage(freelist_t* list, kma_page_t* page);
+static void linkPage(freelist_t* list, p2page_t* page);
+static void unlinkPage(freelist_t* list, p2page_t* page);
+static void releaseSpares();
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -61,13 +99,199 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  freelist_t* list;
+  p2page_t* page;
+  void** buf;
+  int i;
+  
+  if ((size + sizeof(void*)) > PAGESIZE)
+    { // requested size too large
+      return NULL;
+    }
+  
+  if ((size + sizeof(void*)) > MAXBUFSIZE)
+    { // large buffers get a page of their own, tagged with its descriptor
+      kma_page_t* whole = get_page();
+      
+      *((kma_page_t**)whole->ptr) = whole;
+      gNumAlloc++;
+      return whole->ptr + sizeof(kma_page_t*);
+    }
+  
+  i = findClass(size);
+  list = &gFreelist[i];
+  if (list->size == 0)
+    {
+      list->size = MINBUFSIZE << i;
+    }
+  
+  page = list->pages;
+  if (page == NULL)
+    {
+      if (list->spare != NULL)
+	{
+	  page = list->spare;
+	  list->spare = NULL;
+	}
+      else
+	{
+	  page = initPage(list, get_page());
+	}
+      linkPage(list, page);
+    }
+  
+  // pop the first free buffer of the page
+  buf = (void**)page->freebuf;
+  page->freebuf = *buf;
+  page->numalloc++;
+  if (page->freebuf == NULL)
+    { // page is full now
+      unlinkPage(list, page);
+    }
+  
+  // the header remembers the class for kma_free
+  *buf = list;
+  gNumAlloc++;
+  
+  return (void*)(buf + 1);
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  void** buf = ((void**)ptr) - 1;
+  freelist_t* list;
+  p2page_t* page;
+  
+  assert(gNumAlloc > 0);
+  gNumAlloc--;
+  
+  if ((void*)buf == BASEADDR(ptr))
+    { // no carved page puts a buffer at offset 0, so this is a large one
+      free_page(*((kma_page_t**)buf));
+      if (gNumAlloc == 0)
+	{
+	  releaseSpares();
+	}
+      return;
+    }
+  
+  list = (freelist_t*)*buf;
+  page = (p2page_t*)BASEADDR(ptr);
+  
+  if (page->freebuf == NULL)
+    { // the page was full, make it available again
+      linkPage(list, page);
+    }
+  *buf = page->freebuf;
+  page->freebuf = buf;
+  page->numalloc--;
+  
+  if (page->numalloc == 0)
+    {
+      unlinkPage(list, page);
+      if (list->spare == NULL)
+	{
+	  list->spare = page;
+	}
+      else
+	{
+	  free_page(page->page);
+	}
+    }
+  
+  if (gNumAlloc == 0)
+    {
+      releaseSpares();
+    }
+}
+
+// map a request to the smallest class holding it plus the header
+static int
+findClass(kma_size_t size)
+{
+  int i = 0;
+  kma_size_t bufsize = MINBUFSIZE;
+  
+  while (bufsize < (size + sizeof(void*)))
+    {
+      bufsize <<= 1;
+      i++;
+    }
+  return i;
+}
+
+// carve a fresh page into buffers of the list's class
+static p2page_t*
+initPage(freelist_t* list, kma_page_t* newpage)
+{
+  p2page_t* page = (p2page_t*)newpage->ptr;
+  void* buf;
+  void* last;
+  
+  page->page = newpage;
+  page->prev = NULL;
+  page->next = NULL;
+  page->numalloc = 0;
+  page->freebuf = (void*)page + FIRSTBUF;
+  
+  // the last buffer must end within the page
+  last = (void*)page + PAGESIZE - 2 * list->size;
+  for (buf = page->freebuf; buf <= last; buf += list->size)
+    {
+      *((void**)buf) = buf + list->size;
+    }
+  *((void**)buf) = NULL;
+  
+  return page;
+}
+
+// put a page with free buffers at the head of the class page list
+static void
+linkPage(freelist_t* list, p2page_t* page)
+{
+  page->prev = NULL;
+  page->next = list->pages;
+  if (list->pages != NULL)
+    {
+      list->pages->prev = page;
+    }
+  list->pages = page;
+}
+
+static void
+unlinkPage(freelist_t* list, p2page_t* page)
+{
+  if (page->prev != NULL)
+    {
+      page->prev->next = page->next;
+    }
+  else
+    {
+      list->pages = page->next;
+    }
+  if (page->next != NULL)
+    {
+      page->next->prev = page->prev;
+    }
+  page->prev = NULL;
+  page->next = NULL;
+}
+
+// hand the cached empty pages back once nothing is allocated anymore
+static void
+releaseSpares()
+{
+  int i;
+  
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      if (gFreelist[i].spare != NULL)
+	{
+	  free_page(gFreelist[i].spare->page);
+	  gFreelist[i].spare = NULL;
+	}
+    }
 }
 
 #endif // KMA_P2FL
@@ -45,10 +45,18 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef KMA_CONCURRENT
+#include <pthread.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_bitmap.h"
+#include "kma_arena.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -57,16 +65,204 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// the reserved pool is made accessible this many pages at a time, a
+// multiple of the pages in a huge page region
+#define POOLCHUNK 256
+
+// a transparent huge page covers this many bytes of the pool
+#define HUGESIZE (2 << 20)
+#define HUGEPAGES (HUGESIZE / PAGESIZE)
+
+// with POOLHUGE the pool is aligned to huge pages and backed by them
+// where the system allows, pages are taken from regions already in use
+// and only whole regions are purged
+#ifndef POOLHUGE
+#define POOLHUGE 0
+#endif
+#define POOLALIGN (POOLHUGE ? HUGESIZE : PAGESIZE)
+
+// the arenas of the concurrent build share the pool. Single pages are
+// taken from and freed to a lock free stack, the rest takes a lock
+#ifdef KMA_CONCURRENT
+#define LOCK() pthread_mutex_lock(&gPageLock)
+#define UNLOCK() pthread_mutex_unlock(&gPageLock)
+#define ATOMIC_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD(var) __atomic_load_n(&(var), __ATOMIC_SEQ_CST)
+#else
+#define LOCK()
+#define UNLOCK()
+#define ATOMIC_ADD(var, n) ((var) += (n))
+#define ATOMIC_LOAD(var) (var)
+#endif
+
+// the most pages the free stack holds, more go back to the pool
+#ifndef FREESTACK
+#define FREESTACK 512
+#endif
+
+// every thread keeps up to MAGAZINE single pages of its own, and half
+// as many runs of 2 pages and so on up to runs of 2^(MAGCLASSES-1)
+// pages. They are taken from the shared stack and pool and given back
+// half a magazine at a time
+#ifndef MAGAZINE
+#define MAGAZINE 64
+#endif
+#define MAGCLASSES 3
+#define MAGSIZE(class) (MAGAZINE >> (class))
+#define MAGBATCH(class) ((MAGSIZE(class) + 1) / 2)
+#if MAGAZINE < 1 << (MAGCLASSES - 1)
+#error "MAGAZINE is too small for the largest runs"
+#endif
+
+// the top of the free stack is the page index plus one in the low half
+// of a word (0 for an empty stack) and a tag in the high half that
+// every push and pop bumps
+#define STACKINDEX(top) ((int)((top) & 0xFFFFFFFF) - 1)
+#define STACKTOP(index, tag) (((uint64_t)(tag) << 32) | (uint32_t)((index) + 1))
+
+// pages that stay committed when the last page in use is freed, -1
+// keeps the whole pool and 0 gives it back to be set up again later
+#ifndef POOLRETAIN
+#define POOLRETAIN -1
+#endif
+
+// free pages idle for this many frees are given back to the system,
+// the free pages are looked at every PURGEINTERVAL frees (0 never)
+#ifndef PURGEDECAY
+#define PURGEDECAY 4096
+#endif
+#ifndef PURGEINTERVAL
+#define PURGEINTERVAL 1024
+#endif
+
+// MADV_DONTNEED drops the pages at once, MADV_FREE when memory is short
+#ifndef PURGEADVICE
+#define PURGEADVICE MADV_DONTNEED
+#endif
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats =
+  { 0, 0, 0, PAGESIZE, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
+// the counters the lock free paths update too, page_stats() copies
+// them into the statistics
+static struct
+{
+  int num_requested;
+  int num_freed;
+  int num_in_use;
+  long sim_cost;
+  int num_runs;
+  int num_run_pages;
+  int num_refills;
+  int num_flushes;
+} page_counts = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// the pool is a reserved range of page_limit() pages, only the first
+// committed pages of it are accessible. Pages are handed out lowest
+// address first, so pages past the highest one in use were never
+// touched. The pool stays set up when the last page is freed
 static void* pool = NULL;
-static void* next_free_page = NULL;
+static void* pool_map = NULL;
+static size_t pool_map_size = 0;
+static int pool_limit = MAXPAGES;
+static int pool_retain = POOLRETAIN;
+static int pool_backend = PAGEBACKEND;
+static int committed = 0;
+static bool pool_built = FALSE;
+
+#ifdef KMA_CONCURRENT
+static pthread_mutex_t gPageLock = PTHREAD_MUTEX_INITIALIZER;
+
+// single pages freed last, a Treiber stack linked through page_next.
+// Pages on it stay marked in page_map, so nothing else hands them out,
+// purges or decommits them. The tag in the top keeps a pop from
+// succeeding on a page that was popped and pushed again meanwhile
+static uint64_t gFreeTop = 0;
+static int gFreeDepth = 0;
+
+// the pages and runs of the calling thread, valid for one set up of
+// the pool. The key gives them back when the thread exits
+typedef struct
+{
+  int generation;
+  int count;
+  int page[MAGAZINE];
+} magazine_t;
+
+static __thread magazine_t gMagazine[MAGCLASSES];
+static __thread bool gMagazineHooked = FALSE;
+// set once the key gave the magazines back, the destructors of other
+// keys may still free pages after that, which then bypass the magazines
+static __thread bool gMagazineDrained = FALSE;
+static pthread_key_t gMagazineKey;
+static pthread_once_t gMagazineOnce = PTHREAD_ONCE_INIT;
+static int gGeneration = 0;
+#endif
+
+// simulated nanoseconds per request, free and first write of a page
+static int cost_get = COSTGET;
+static int cost_free = COSTFREE;
+static int cost_fault = COSTFAULT;
+
+// a set bit for every page that is handed out, pages and runs are
+// taken lowest address first so free pages stay together
+static kma_bitmap_t* page_map = NULL;
+
+// no page below this index is free
+static int first_free = 0;
+
+// a set bit for every page written to since it was committed or
+// purged, and for every purged page that was not handed out since
+static kma_bitmap_t* dirty_map = NULL;
+static kma_bitmap_t* purged_map = NULL;
+
+// frees so far, and the count at which each free page was freed
+static unsigned int purge_clock = 0;
+static unsigned int* page_freed = NULL;
+
+// a set bit for every huge page region with pages written to that was
+// not purged or decommitted since
+static kma_bitmap_t* touched_map = NULL;
+
+// the arena that requested each page in use
+static unsigned char* page_owner = NULL;
+
+// the page below each page on the free stack
+static int* page_next = NULL;
+
+// the descriptor of a page or run is the entry of its first page
+static kma_page_t* page_desc = NULL;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+kma_page_t* handOut(void*, int);
+void* allocPages(int);
+void freePages(void*, int);
+void commitPages(int);
+void mapPages(int, int);
+void charge(long);
+void unmapPages(int, int);
+int decommitPages(int);
+void purgePages();
+void purgeRun(int, int);
+int findTouched(int, int, int);
+void touchRegions(int, int);
 void initPages();
+void releasePages();
+size_t metaSize();
+#ifdef KMA_CONCURRENT
+int popFree();
+bool pushFree(int);
+int magClass(int);
+int takeCached(int);
+void refillMagazine(int);
+void flushMagazine(int, int);
+void hookMagazine();
+void drainMagazine(void*);
+void drainStack();
+void retainPages();
+void makeMagazineKey();
+#endif
 
 /************External Declaration*****************************************/
 
@@ -75,34 +271,139 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
+  return get_pages(1);
+}
+
+kma_page_t*
+get_pages(int n)
+{
   kma_page_t* res;
+  void* ptr;
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  assert(n > 0 && n <= pool_limit);
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  ATOMIC_ADD(page_counts.num_requested, n);
+  ATOMIC_ADD(page_counts.num_in_use, n);
+  if (n > 1)
+    {
+      ATOMIC_ADD(page_counts.num_runs, 1);
+      ATOMIC_ADD(page_counts.num_run_pages, n);
+    }
+  
+#ifdef KMA_CONCURRENT
+  int class = magClass(n);
+  int index;
+  
+  if (class >= 0 && !gMagazineDrained
+      && (index = takeCached(class)) >= 0)
+    {
+      return handOut(pool + index * (long)PAGESIZE, n);
+    }
+#endif
   
-  assert(res->ptr != NULL);
+  // only a request that goes to the pool is charged, the magazines
+  // and the stack are the cache that saves the cost
+  charge(cost_get);
   
-  return res;	
+  LOCK();
+  ptr = allocPages(n);
+  
+  assert(ptr != NULL);
+  
+  res = handOut(ptr, n);
+  UNLOCK();
+  
+  return res;
 }
 
 void
 free_page(kma_page_t* ptr)
 {
-  assert(ptr != NULL);
-  assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  free_pages(ptr);
+}
+
+void
+free_pages(kma_page_t* run)
+{
+  assert(run != NULL);
+  assert(run->ptr != NULL);
+  assert(run->size > 0 && run->size % PAGESIZE == 0);
+  
+  assert(run == page_desc_of(run->ptr));
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  int n = run->size / PAGESIZE;
+  void* ptr = run->ptr;
+  
+  // purging is amortized over all frees, the ones that only go into a
+  // magazine or onto the stack move the clock as well
+  bool purge = PURGEINTERVAL > 0
+    && ATOMIC_ADD(purge_clock, 1) % PURGEINTERVAL == 0;
+  
+  ATOMIC_ADD(page_counts.num_freed, n);
+  run->ptr = NULL;
+  
+#ifdef KMA_CONCURRENT
+  int class = magClass(n);
+  
+  // the pages count as in use until they are in the magazine, so the
+  // pool is never given back under them
+  if (class >= 0 && !gMagazineDrained)
+    {
+      magazine_t* mag = &gMagazine[class];
+      
+      hookMagazine();
+      if (mag->generation != ATOMIC_LOAD(gGeneration))
+	{
+	  mag->generation = ATOMIC_LOAD(gGeneration);
+	  mag->count = 0;
+	}
+      if (mag->count == MAGSIZE(class))
+	{
+	  flushMagazine(class, MAGBATCH(class));
+	}
+      mag->page[mag->count++] = page_index(ptr);
+      
+      assert(ATOMIC_LOAD(page_counts.num_in_use) >= n);
+      ATOMIC_ADD(page_counts.num_in_use, -n);
+      
+      if (purge)
+	{
+	  LOCK();
+	  purgePages();
+	  UNLOCK();
+	}
+      return;
+    }
+#endif
+  
+  charge(cost_free);
+  
+  LOCK();
+  assert(ATOMIC_LOAD(page_counts.num_in_use) >= n);
+  
+  freePages(ptr, n);
+  
+  if (purge)
+    {
+      purgePages();
+    }
   
-  freePage(ptr->ptr);
-  free(ptr);
+  if (ATOMIC_ADD(page_counts.num_in_use, -n) == 0)
+    {
+#ifdef KMA_CONCURRENT
+      retainPages();
+#else
+      if (pool_retain == 0)
+	{
+	  releasePages();
+	}
+      else if (pool_retain > 0)
+	{
+	  decommitPages(pool_retain);
+	}
+#endif
+    }
+  UNLOCK();
 }
 
 kma_page_stat_t*
@@ -110,71 +411,770 @@ page_stats()
 {
   static kma_page_stat_t stats;
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  LOCK();
+  memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  stats.num_marked = pool != NULL ? bitmap_count(page_map, 0, committed) : 0;
+  UNLOCK();
+  stats.num_requested = ATOMIC_LOAD(page_counts.num_requested);
+  stats.num_freed = ATOMIC_LOAD(page_counts.num_freed);
+  stats.num_in_use = ATOMIC_LOAD(page_counts.num_in_use);
+  stats.sim_cost = ATOMIC_LOAD(page_counts.sim_cost);
+  stats.num_runs = ATOMIC_LOAD(page_counts.num_runs);
+  stats.num_run_pages = ATOMIC_LOAD(page_counts.num_run_pages);
+  stats.num_refills = ATOMIC_LOAD(page_counts.num_refills);
+  stats.num_flushes = ATOMIC_LOAD(page_counts.num_flushes);
+#ifdef KMA_CONCURRENT
+  stats.num_stacked = __atomic_load_n(&gFreeDepth, __ATOMIC_RELAXED);
+#endif
+  
+  return &stats;
+}
+
+int
+page_index(void* ptr)
+{
+  assert(pool != NULL);
+  assert(BASEADDR(ptr) >= pool && BASEADDR(ptr) < pool + pool_limit * (long)PAGESIZE);
+  
+  return (BASEADDR(ptr) - pool) / PAGESIZE;
 }
 
 void*
-allocPage()
+page_addr(int index)
 {
-  void* res;
+  assert(pool != NULL);
+  assert(index >= 0 && index < pool_limit);
+  
+  return pool + index * (long)PAGESIZE;
+}
+
+kma_page_t*
+page_desc_of(void* ptr)
+{
+  return &page_desc[page_index(ptr)];
+}
+
+int
+page_arena(void* ptr)
+{
+  return page_owner[page_index(ptr)];
+}
+
+void
+set_page_limit(int pages)
+{
+  assert(pages > 0);
+  
+  LOCK();
+  assert(ATOMIC_LOAD(page_counts.num_in_use) == 0);
+  
+  // the pool is set up again for the new limit on the next request
+  if (pool != NULL && pages != pool_limit)
+    {
+      releasePages();
+    }
+  pool_limit = pages;
+  UNLOCK();
+}
+
+void
+set_page_backend(int backend)
+{
+  assert(backend == PAGE_POOL || backend == PAGE_MMAP);
+  
+  LOCK();
+  assert(ATOMIC_LOAD(page_counts.num_in_use) == 0);
+  
+  // the pool is set up again, none of its pages is mapped then
+  if (pool != NULL && backend != pool_backend)
+    {
+      releasePages();
+    }
+  pool_backend = backend;
+  UNLOCK();
+}
+
+void
+set_page_cost(int get, int free, int fault)
+{
+  assert(get >= 0 && free >= 0 && fault >= 0);
+  
+  cost_get = get;
+  cost_free = free;
+  cost_fault = fault;
+}
+
+int
+page_limit()
+{
+  return pool_limit;
+}
+
+void
+set_page_retain(int pages)
+{
+  assert(pages >= -1);
+  
+  LOCK();
+  pool_retain = pages;
+#ifdef KMA_CONCURRENT
+  // a drained pool follows the new policy right away
+  if (pool != NULL && ATOMIC_LOAD(page_counts.num_in_use) == 0)
+    {
+      retainPages();
+    }
+#endif
+  UNLOCK();
+}
+
+int
+kma_page_trim()
+{
+  int n = 0;
+  
+  LOCK();
+  if (pool != NULL)
+    {
+#ifdef KMA_CONCURRENT
+      drainStack();
+#endif
+      n = decommitPages(bitmap_findlast(page_map, committed) + 1);
+    }
+  UNLOCK();
+  
+  return n;
+}
+
+// fill in the descriptor of n pages at ptr for the calling arena
+kma_page_t*
+handOut(void* ptr, int n)
+{
+  static int id = 0;
+  int index = page_index(ptr);
+  kma_page_t* res = &page_desc[index];
+  
+  res->id = ATOMIC_ADD(id, 1) - 1;
+  res->size = n * PAGESIZE;
+  res->ptr = ptr;
+  memset(&page_owner[index], kma_arena, n);
+  
+  return res;
+}
+
+#ifdef KMA_CONCURRENT
+// the page on top of the free stack, or -1 if it is empty
+int
+popFree()
+{
+  uint64_t top = __atomic_load_n(&gFreeTop, __ATOMIC_ACQUIRE);
+  int index;
+  
+  do
+    {
+      index = STACKINDEX(top);
+      if (index < 0)
+	{
+	  return -1;
+	}
+    }
+  while (!__atomic_compare_exchange_n(&gFreeTop, &top,
+				      STACKTOP(__atomic_load_n(&page_next[index],
+							       __ATOMIC_RELAXED),
+					       (top >> 32) + 1),
+				      TRUE, __ATOMIC_ACQUIRE,
+				      __ATOMIC_ACQUIRE));
+  __atomic_sub_fetch(&gFreeDepth, 1, __ATOMIC_RELAXED);
+  
+  return index;
+}
+
+// put a page on the free stack, FALSE if it holds FREESTACK pages
+bool
+pushFree(int index)
+{
+  uint64_t top;
+  
+  if (__atomic_add_fetch(&gFreeDepth, 1, __ATOMIC_RELAXED) > FREESTACK)
+    {
+      __atomic_sub_fetch(&gFreeDepth, 1, __ATOMIC_RELAXED);
+      return FALSE;
+    }
+  
+  top = __atomic_load_n(&gFreeTop, __ATOMIC_RELAXED);
+  do
+    {
+      __atomic_store_n(&page_next[index], STACKINDEX(top), __ATOMIC_RELAXED);
+    }
+  while (!__atomic_compare_exchange_n(&gFreeTop, &top,
+				      STACKTOP(index, (top >> 32) + 1),
+				      TRUE, __ATOMIC_RELEASE,
+				      __ATOMIC_RELAXED));
+  
+  return TRUE;
+}
+
+// the magazine for runs of n pages, or -1 if there is none
+int
+magClass(int n)
+{
+  int class = __builtin_ctz(n);
+  
+  if (pool_backend != PAGE_POOL || n != 1 << class || class >= MAGCLASSES)
+    {
+      return -1;
+    }
+  return class;
+}
+
+// the first page of a run from the magazine of the calling thread,
+// refilled when it is empty
+int
+takeCached(int class)
+{
+  magazine_t* mag = &gMagazine[class];
+  
+  if (mag->generation != ATOMIC_LOAD(gGeneration) || mag->count == 0)
+    {
+      refillMagazine(class);
+    }
+  
+  return mag->page[--mag->count];
+}
+
+// fill half a magazine, single pages come from the stack first and the
+// rest from the pool under one lock
+void
+refillMagazine(int class)
+{
+  magazine_t* mag = &gMagazine[class];
+  int index;
+  
+  hookMagazine();
+  if (mag->generation != ATOMIC_LOAD(gGeneration))
+    {
+      mag->generation = ATOMIC_LOAD(gGeneration);
+      mag->count = 0;
+    }
+  
+  while (class == 0 && mag->count < MAGBATCH(0)
+	 && (index = popFree()) >= 0)
+    {
+      mag->page[mag->count++] = index;
+    }
+  
+  if (mag->count < MAGBATCH(class))
+    {
+      charge(cost_get);
+      LOCK();
+      while (mag->count < MAGBATCH(class))
+	{
+	  mag->page[mag->count++] = page_index(allocPages(1 << class));
+	}
+      UNLOCK();
+    }
+  ATOMIC_ADD(page_counts.num_refills, 1);
+}
+
+// give the n runs on top of a magazine back, single pages to the stack
+// while it has room, and the rest to the pool under one lock
+void
+flushMagazine(int class, int n)
+{
+  magazine_t* mag = &gMagazine[class];
+  int last = mag->count - n;
+  
+  while (class == 0 && mag->count > last
+	 && pushFree(mag->page[mag->count - 1]))
+    {
+      mag->count--;
+    }
+  
+  if (mag->count > last)
+    {
+      charge(cost_free);
+      LOCK();
+      while (mag->count > last)
+	{
+	  freePages(page_addr(mag->page[--mag->count]), 1 << class);
+	}
+      UNLOCK();
+    }
+  ATOMIC_ADD(page_counts.num_flushes, 1);
+}
+
+// have the key give the magazines back when the calling thread exits,
+// before anything goes into them
+void
+hookMagazine()
+{
+  if (!gMagazineHooked)
+    {
+      pthread_once(&gMagazineOnce, makeMagazineKey);
+      pthread_setspecific(gMagazineKey, gMagazine);
+      gMagazineHooked = TRUE;
+    }
+}
+
+// give back the magazines of an exiting thread
+void
+drainMagazine(void* magazines)
+{
+  int class;
+  
+  for (class = 0; class < MAGCLASSES; class++)
+    {
+      magazine_t* mag = &((magazine_t*)magazines)[class];
+      
+      if (mag->generation == ATOMIC_LOAD(gGeneration) && mag->count > 0)
+	{
+	  flushMagazine(class, mag->count);
+	}
+    }
+  gMagazineDrained = TRUE;
+}
+
+// give the pages on the free stack back to the bitmap, so trimming,
+// purging and retention see them as free. Called with the lock held
+void
+drainStack()
+{
+  int index;
+  
+  while ((index = popFree()) >= 0)
+    {
+      freePages(page_addr(index), 1);
+    }
+}
+
+// with no page in use empty the free stack and keep pool_retain pages
+// committed. Other threads may still use the stack, so the pool stays
+// mapped, and the pages in their magazines stay committed too. Called
+// with the lock held
+void
+retainPages()
+{
+  drainStack();
+  if (pool_retain >= 0)
+    {
+      int last = bitmap_findlast(page_map, committed) + 1;
+      
+      decommitPages(last > pool_retain ? last : pool_retain);
+    }
+}
+
+void
+makeMagazineKey()
+{
+  pthread_key_create(&gMagazineKey, drainMagazine);
+}
+#endif
+
+void*
+allocPages(int n)
+{
+  int align = 1;
+  int base, first, faults;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  // runs of a power of two pages are aligned to their size
+  if ((n & (n - 1)) == 0)
+    {
+      align = n;
+    }
   
-  if (res == NULL)
+  // start the search at a whole word that keeps the alignment
+  base = first_free & ~((align > BITMAP_BITS ? align : BITMAP_BITS) - 1);
+  first = bitmap_findclear(page_map + base / BITMAP_BITS, pool_limit - base,
+			   n, align);
+  if (first < 0)
     {
-      error("error: all pages already allocated", "");
+      error(n == 1 ? "error: all pages already allocated"
+	    : "error: no run of free pages left", "");
     }
+  first += base;
   
-  next_free_page = *((void**)next_free_page);
+  // a region that is written to already is backed, so rather take the
+  // pages from one of those than start on a new one
+  if (POOLHUGE && n < HUGEPAGES
+      && bitmap_isclear(touched_map, first / HUGEPAGES, 1))
+    {
+      int touched = findTouched(first / HUGEPAGES + 1, n, align);
+      
+      if (touched >= 0)
+	{
+	  first = touched;
+	}
+    }
   
-  assert(res != NULL);
+  if (pool_backend == PAGE_MMAP)
+    {
+      mapPages(first, n);
+    }
+  else if (first + n > committed)
+    {
+      commitPages(first + n);
+    }
   
-  return res;
+  bitmap_set(page_map, first, n);
+  
+  // purged pages fault in again when they are written to
+  if (!bitmap_isclear(purged_map, first, n))
+    {
+      kma_page_stats.num_refaulted += bitmap_count(purged_map, first, n);
+      bitmap_clear(purged_map, first, n);
+    }
+  // pages not written to since they were committed, purged or mapped
+  // fault in when the allocator first writes to them
+  faults = n - bitmap_count(dirty_map, first, n);
+  kma_page_stats.num_faults += faults;
+  charge(faults * (long)cost_fault);
+  
+  bitmap_set(dirty_map, first, n);
+  touchRegions(first, n);
+  
+  if (first == first_free)
+    {
+      first_free = first + n;
+    }
+  
+  return pool + first * (long)PAGESIZE;
 }
 
 void
-freePage(void* ptr)
+freePages(void* ptr, int n)
 {
+  int first = page_index(ptr);
+  int i;
+  
   assert(ptr != NULL);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  bitmap_clear(page_map, first, n);
+  for (i = first; i < first + n; i++)
+    {
+      page_freed[i] = ATOMIC_LOAD(purge_clock);
+    }
   
-  if (kma_page_stats.num_in_use == 0)
+  if (pool_backend == PAGE_MMAP)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      unmapPages(first, n);
+    }
+  if (first < first_free)
+    {
+      first_free = first;
     }
 }
 
+// make the pool accessible up to page upto, a chunk at a time
 void
-initPages()
+commitPages(int upto)
 {
-  int i;
+  int end = (upto + POOLCHUNK - 1) / POOLCHUNK * POOLCHUNK;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  if (end > pool_limit)
+    {
+      end = pool_limit;
+    }
+  
+  if (mprotect(pool + committed * (long)PAGESIZE,
+	       (end - committed) * (long)PAGESIZE, PROT_READ | PROT_WRITE))
+    {
+      error("error: cannot commit pool pages", "");
+    }
+  kma_page_stats.num_syscalls++;
+  
+  // the system may not support huge pages, the pool works without them
+  if (POOLHUGE)
+    {
+      madvise(pool + committed * (long)PAGESIZE,
+	      (end - committed) * (long)PAGESIZE, MADV_HUGEPAGE);
+      kma_page_stats.num_syscalls++;
+    }
+  committed = end;
+}
+
+// add to the simulated cost, with COSTSPIN spend it as well
+void
+charge(long ns)
+{
+  ATOMIC_ADD(page_counts.sim_cost, ns);
+  
+#ifdef COSTSPIN
+  struct timespec start, now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+  while ((now.tv_sec - start.tv_sec) * 1000000000L
+	 + now.tv_nsec - start.tv_nsec < ns);
+#endif
+}
+
+// map n fresh pages from page first into the reservation, with this
+// backend committed is just past the highest page handed out so far
+void
+mapPages(int first, int n)
+{
+  if (mmap(pool + first * (long)PAGESIZE, n * (long)PAGESIZE,
+	   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+	   -1, 0) == MAP_FAILED)
+    {
+      error("error: cannot map pages", "");
+    }
+  kma_page_stats.num_syscalls++;
+  
+  if (first + n > committed)
+    {
+      committed = first + n;
+    }
+}
+
+// unmap n pages from page first, their addresses stay reserved
+void
+unmapPages(int first, int n)
+{
+  if (mmap(pool + first * (long)PAGESIZE, n * (long)PAGESIZE, PROT_NONE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+      == MAP_FAILED)
+    {
+      error("error: cannot unmap pages", "");
+    }
+  kma_page_stats.num_syscalls++;
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  // nothing is left to purge
+  bitmap_clear(dirty_map, first, n);
+}
+
+// give the committed pages from page from on back, a chunk at a time
+int
+decommitPages(int from)
+{
+  int start = (from + POOLCHUNK - 1) / POOLCHUNK * POOLCHUNK;
+  int n = committed - start;
+  int regions;
+  
+  // the mmap backend has nothing mapped besides the pages in use
+  if (n <= 0 || pool_backend == PAGE_MMAP)
+    {
+      return 0;
+    }
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  // a fresh reservation over the range drops its contents
+  if (mmap(pool + start * (long)PAGESIZE, n * (long)PAGESIZE, PROT_NONE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+      == MAP_FAILED)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      error("error: cannot decommit pool pages", "");
+    }
+  kma_page_stats.num_syscalls++;
+  bitmap_clear(dirty_map, start, n);
+  bitmap_clear(purged_map, start, n);
+  regions = (committed + HUGEPAGES - 1) / HUGEPAGES - start / HUGEPAGES;
+  kma_page_stats.num_huge_regions -=
+    bitmap_count(touched_map, start / HUGEPAGES, regions);
+  bitmap_clear(touched_map, start / HUGEPAGES, regions);
+  committed = start;
+  kma_page_stats.num_trimmed += n;
+  
+  return n;
+}
+
+// give the free pages that were idle for PURGEDECAY frees back to the
+// system, one call for every run of them
+void
+purgePages()
+{
+  int word, start = 0, end = 0;
+  unsigned int now = ATOMIC_LOAD(purge_clock);
+  
+  for (word = 0; word < BITMAP_WORDS(committed); word++)
+    {
+      kma_bitmap_t idle = dirty_map[word] & ~page_map[word];
       
-      *((void**) ptr) = next;
+      while (idle)
+	{
+	  int i = word * BITMAP_BITS + __builtin_ctzll(idle);
+	  
+	  idle &= idle - 1;
+	  if (now - page_freed[i] < PURGEDECAY)
+	    {
+	      continue;
+	    }
+	  if (i != end)
+	    {
+	      purgeRun(start, end - start);
+	      start = i;
+	    }
+	  end = i + 1;
+	}
+    }
+  purgeRun(start, end - start);
+}
+
+void
+purgeRun(int first, int n)
+{
+  int end = first + n;
+  
+  // purging part of a region would split its huge page
+  if (POOLHUGE)
+    {
+      first = (first + HUGEPAGES - 1) / HUGEPAGES * HUGEPAGES;
+      end = end / HUGEPAGES * HUGEPAGES;
+      n = end - first;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  if (n <= 0)
+    {
+      return;
+    }
+  
+  if (madvise(pool + first * (long)PAGESIZE, n * (long)PAGESIZE,
+	      PURGEADVICE))
+    {
+      error("error: cannot purge pool pages", "");
+    }
+  kma_page_stats.num_syscalls++;
+  bitmap_clear(dirty_map, first, n);
+  bitmap_set(purged_map, first, n);
+  kma_page_stats.num_purged += n;
+  
+  // the regions purged as a whole are no longer backed
+  first = (first + HUGEPAGES - 1) / HUGEPAGES;
+  end /= HUGEPAGES;
+  if (end > first)
+    {
+      kma_page_stats.num_huge_regions -=
+	bitmap_count(touched_map, first, end - first);
+      bitmap_clear(touched_map, first, end - first);
+    }
+}
+
+// the first fit for n pages in a touched region from region on, or -1
+int
+findTouched(int region, int n, int align)
+{
+  int word;
+  
+  for (word = region / BITMAP_BITS;
+       word < BITMAP_WORDS((committed + HUGEPAGES - 1) / HUGEPAGES); word++)
+    {
+      kma_bitmap_t touched = touched_map[word];
+      
+      if (word == region / BITMAP_BITS)
+	{
+	  touched &= ~(kma_bitmap_t)0 << (region % BITMAP_BITS);
+	}
+      while (touched)
+	{
+	  int first = (word * BITMAP_BITS + __builtin_ctzll(touched))
+	    * HUGEPAGES;
+	  int size = pool_limit - first < HUGEPAGES
+	    ? pool_limit - first : HUGEPAGES;
+	  int fit;
+	  
+	  touched &= touched - 1;
+	  fit = bitmap_findclear(page_map + first / BITMAP_BITS, size, n, align);
+	  if (fit >= 0)
+	    {
+	      return first + fit;
+	    }
+	}
+    }
+  
+  return -1;
+}
+
+// mark the regions of n pages from first as touched
+void
+touchRegions(int first, int n)
+{
+  int region = first / HUGEPAGES;
+  int count = (first + n - 1) / HUGEPAGES - region + 1;
+  
+  kma_page_stats.num_huge_regions +=
+    count - bitmap_count(touched_map, region, count);
+  bitmap_set(touched_map, region, count);
+}
+
+void
+initPages()
+{
+  void* meta;
+  
+  assert(pool == NULL);
+  
+  if (pool_built)
+    {
+      kma_page_stats.num_rebuilds++;
+    }
+  pool_built = TRUE;
+  
+  // reserve the whole pool without backing it, with room to align it
+  pool_map_size = pool_limit * (long)PAGESIZE + POOLALIGN;
+  pool_map = mmap(NULL, pool_map_size, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pool_map == MAP_FAILED)
+    error("error: cannot reserve the page pool", "");
+  pool = (void*)(((long)pool_map + POOLALIGN - 1) & ~((long)POOLALIGN - 1));
+  committed = 0;
+  
+  // the bitmap and the descriptors are only backed where they are touched
+  meta = mmap(NULL, metaSize(), PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (meta == MAP_FAILED)
+    error("error: cannot map the page tables", "");
+  kma_page_stats.num_syscalls += 2;
+  page_desc = meta;
+  page_map = (kma_bitmap_t*)(page_desc + pool_limit);
+  dirty_map = page_map + BITMAP_WORDS(pool_limit);
+  purged_map = dirty_map + BITMAP_WORDS(pool_limit);
+  touched_map = purged_map + BITMAP_WORDS(pool_limit);
+  page_freed = (unsigned int*)(touched_map + BITMAP_WORDS(pool_limit));
+  page_next = (int*)(page_freed + pool_limit);
+  page_owner = (unsigned char*)(page_next + pool_limit);
+  
+  first_free = 0;
+}
+
+// give the pool and its tables back, no page may be in use
+void
+releasePages()
+{
+  munmap(page_desc, metaSize());
+  munmap(pool_map, pool_map_size);
+  kma_page_stats.num_syscalls += 2;
+  pool = NULL;
+  pool_map = NULL;
+  page_desc = NULL;
+  page_map = NULL;
+  dirty_map = NULL;
+  purged_map = NULL;
+  touched_map = NULL;
+  page_freed = NULL;
+  page_owner = NULL;
+  page_next = NULL;
+  committed = 0;
+#ifdef KMA_CONCURRENT
+  // the stack lived in the tables, and the magazines refer to them
+  gFreeTop = 0;
+  gFreeDepth = 0;
+  ATOMIC_ADD(gGeneration, 1);
+#endif
+}
+
+// bytes of the descriptor table, the page, dirty, purged and region
+// bitmaps, the free times, the free stack links and the arenas of the
+// pages
+size_t
+metaSize()
+{
+  return pool_limit * sizeof(kma_page_t)
+    + 4 * BITMAP_WORDS(pool_limit) * sizeof(kma_bitmap_t)
+    + pool_limit * (sizeof(unsigned int) + sizeof(int) + sizeof(unsigned char));
 }
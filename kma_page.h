@@ -64,7 +64,33 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+// default limit of the page pool, see set_page_limit()
+#ifndef MAXPAGES
+#define MAXPAGES 65536
+#endif
+
+// where pages come from: the pool commits its pages once and keeps
+// them, the mmap backend maps every page or run when it is handed out
+// and unmaps it when it is freed, see set_page_backend()
+#define PAGE_POOL 0
+#define PAGE_MMAP 1
+
+#ifndef PAGEBACKEND
+#define PAGEBACKEND PAGE_POOL
+#endif
+
+// simulated cost in nanoseconds of asking the system for pages, of
+// giving them back and of the fault on the first write to a page, see
+// set_page_cost(). With COSTSPIN the costs are also spent busy waiting
+#ifndef COSTGET
+#define COSTGET 2000
+#endif
+#ifndef COSTFREE
+#define COSTFREE 1000
+#endif
+#ifndef COSTFAULT
+#define COSTFAULT 250
+#endif
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -89,6 +115,20 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_runs;       // runs of more than one page requested
+  int num_run_pages;  // pages requested as part of such runs
+  int num_rebuilds;   // times the pool was set up again after a release
+  int num_trimmed;    // committed pages given back by retention and trims
+  int num_purged;     // idle free pages given back with madvise()
+  int num_refaulted;  // purged pages that were handed out again
+  int num_huge_regions; // 2 MB regions written to and not given back
+  int num_syscalls;   // mmap(), munmap(), mprotect() and madvise() calls
+  int num_faults;     // pages handed out that were not written to before
+  long sim_cost;      // simulated cost of the requests, frees and faults
+  int num_refills;    // batches taken into per thread page magazines
+  int num_flushes;    // batches given back from them
+  int num_marked;     // pages marked in the bitmap, in use or cached
+  int num_stacked;    // pages on the free stack
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -104,6 +144,19 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of n pages that follow each other in
+ *             the pool. The lowest free run is taken, and a run of a
+ *             power of two pages starts at a page index that is a
+ *             multiple of n. Every page of the run counts in the page
+ *             statistics
+ *    Input: the number of pages
+ *    Output: the allocated run, its size is n * PAGESIZE
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int n);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
@@ -113,6 +166,15 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases all pages of a run returned by get_pages()
+ *    Input: the pointer to the memory page structure of the run
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t* run);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -122,6 +184,114 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page index
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the position of a page within the page pool, so
+ *             allocators can keep tables indexed by page
+ *    Input: any pointer into a page returned by get_page()
+ *    Output: the page index, between 0 and page_limit() - 1
+ ***********************************************************************/
+EXTERN int page_index(void*);
+
+/***********************************************************************
+ *  Title: Page address
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the start of a page from its position in the pool
+ *    Input: the page index, between 0 and page_limit() - 1
+ *    Output: the first byte of the page
+ ***********************************************************************/
+EXTERN void* page_addr(int);
+
+/***********************************************************************
+ *  Title: Page descriptor
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the descriptor returned by get_page() or get_pages()
+ *             without storing it. Descriptors live in a table with
+ *             one entry per pool page, a run uses the entry of its
+ *             first page
+ *    Input: any pointer into the first page of a page or run
+ *    Output: the descriptor of that page or run
+ ***********************************************************************/
+EXTERN kma_page_t* page_desc_of(void*);
+
+/***********************************************************************
+ *  Title: Page arena
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the arena that requested a page, see kma_arena.h
+ *    Input: any pointer into a page in use
+ *    Output: the arena, 0 unless built with KMA_CONCURRENT
+ ***********************************************************************/
+EXTERN int page_arena(void*);
+
+/***********************************************************************
+ *  Title: Sets the pool limit
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets how many pages the pool may grow to. The pool only
+ *             reserves address space for them and makes it accessible
+ *             as pages are handed out. Can only be changed while no
+ *             page is in use, the pool is then set up again
+ *    Input: the number of pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_limit(int);
+
+/***********************************************************************
+ *  Title: Sets the page backend
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses whether pages are kept in the pool or mapped
+ *             and unmapped with every request and free, which charges
+ *             the allocators the system calls and page faults. Can
+ *             only be changed while no page is in use
+ *    Input: PAGE_POOL (default, see PAGEBACKEND) or PAGE_MMAP
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_backend(int);
+
+/***********************************************************************
+ *  Title: Sets the simulated page costs
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets what get_page() and get_pages(), free_page() and
+ *             free_pages() and the first write to a page handed out
+ *             are charged in the statistics, to compare allocators as
+ *             if pages came from a system with these costs
+ *    Input: the nanoseconds per request, per free and per fault
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_cost(int, int, int);
+
+/***********************************************************************
+ *  Title: Pool limit
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of pages the pool may grow to, so
+ *             allocators can size tables indexed by page
+ *    Input: none
+ *    Output: the pool limit in pages
+ ***********************************************************************/
+EXTERN int page_limit();
+
+/***********************************************************************
+ *  Title: Sets the pool retention
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets how many pages stay committed when the last page
+ *             in use is freed. The rest of the pool is given back and
+ *             made accessible again when it is needed
+ *    Input: the number of pages, -1 keeps the whole pool (default)
+ *           and 0 releases the pool so it is set up from scratch
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_retain(int);
+
+/***********************************************************************
+ *  Title: Trims the pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives back the committed pages above the highest page
+ *             in use, a chunk at a time
+ *    Input: none
+ *    Output: the number of pages given back
+ ***********************************************************************/
+EXTERN int kma_page_trim();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
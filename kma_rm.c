@@ -41,6 +41,7 @@
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_arena.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -49,34 +50,86 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-//doubly linked list hold available free blocks
-typedef struct
+//every block starts with a boundary tag holding its size, whether it is
+//free and whether the block in front of it is free; free blocks repeat
+//their size in a footer, so both neighbours are found in O(1)
+//free blocks are indexed by a treap keyed by size and, for the address
+//ordered policies, by a treap keyed by address where every node also
+//knows the largest block below it
+typedef struct freeblock
 {
 	/* data */
-	int size;		//size of current freeblock
-	void *next;	//next free block
-	void *prev;	//prev free block
-	void *pageid;	//id of page
+	long tag;		//boundary tag: size of the block and flags
+	int maxsize;		//largest block in this subtree of the address tree
+	struct freeblock *left;	//address tree
+	struct freeblock *right;
+	struct freeblock *sleft;	//size tree
+	struct freeblock *sright;
 } freeblockL;
 
-//header to ll
+#define BLOCKFREE 1
+#define PREVFREE 2
+#define BLOCKSIZE(b) ((int) (((freeblockL *) (b))->tag & ~(long) (sizeof(long) - 1)))
+#define NEXTBLOCK(b) ((freeblockL *) ((long) (b) + BLOCKSIZE(b)))
+#define FOOTER(b) (*((long *) NEXTBLOCK(b) - 1))
+
+//header at the beginning of every page
 typedef struct
 {
 	/* data */
 	void *self;		//copy of lheader pointer, used to free page
-	int numpages;
 	int numalloc;	//number of allocated blocks per page
-	freeblockL *header;	//head of free list
 } lheader;
 
+//roots of the free block index, kept outside the pages so any empty page can go
+typedef struct
+{
+	/* data */
+	freeblockL *addrroot;	//root of the address tree
+	freeblockL *sizeroot;	//root of the size tree
+	void *rover;		//where next fit continues searching
+	lheader *spare;		//empty page kept to absorb churn
+	int numpages;
+	int numalloc;	//number of allocated blocks on all pages
+} rmindex;
+
+//allocation policies, pick one with -DRM_POLICY=...
+#define RM_FIRSTFIT 0
+#define RM_BESTFIT 1
+#define RM_NEXTFIT 2
+
+#ifndef RM_POLICY
+#define RM_POLICY RM_FIRSTFIT
+#endif
+
+//best fit only needs the size tree
+#define RM_ADDRINDEX (RM_POLICY != RM_BESTFIT)
+
+//a free block must hold its tree node and its footer
+#define MINBLOCK ((int) (sizeof(freeblockL) + sizeof(long)))
+
+//a page holds its header, the blocks and a used tag closing the last block
+#define PAGEBLOCK ((int) (PAGESIZE - sizeof(lheader) - sizeof(long)))
+#define MAXPAYLOAD (PAGEBLOCK - (int) sizeof(long))
+
 /************Global Variables*********************************************/
-kma_page_t *entryptr = 0;		//entry ptr to first page
+static rmindex mainindices[NUMARENAS];	//one index per arena, see kma_arena.h
+#define mainindex mainindices[kma_arena]
 /************Function Prototypes******************************************/
-void *findfirstfit(int size);		//return pointer to free space using first fit
-void addtofreelist (void* ptr, int size);	//addtofreelists pointer to free space 
-void freeunalloc(void);	//looks for pages being used with no allocated blocks and frees those pages
-void remove(void *ptr);	//remove pointer from list
-void initial(kma_page_t* page, int first);	//initialize page
+void *findfit(int size);		//return a block of size bytes using the configured policy
+void addtofreelist (void* ptr);	//free a block, coalescing with its neighbours
+void releasepage(lheader *page);	//free a page without allocated blocks
+void remove(void *ptr);	//remove block from the index
+void markblock(freeblockL *block, int size);	//mark block free in the boundary tags
+void insertblock(freeblockL *block, int size);	//mark block free and add it to the index
+void initial(kma_page_t* page);	//initialize page
+int roundsize(int size);	//block size taken by a request
+freeblockL *firstfitfrom(freeblockL *node, void *from, int size);	//lowest addressed fit at or after from
+freeblockL *bestfit(int size);	//smallest fit
+freeblockL *addrinsert(freeblockL *root, freeblockL *node);
+freeblockL *addrdelete(freeblockL *root, freeblockL *node);
+freeblockL *sizeinsert(freeblockL *root, freeblockL *node);
+freeblockL *sizedelete(freeblockL *root, freeblockL *node);
 
 /************External Declaration*****************************************/
 
@@ -92,250 +145,387 @@ kma_malloc(kma_size_t size)
 
 	void *ret;
 
-	if (!entryptr)		//initialize first page if entryptr is null
-		initial(get_page(), 1);
-	
-	//call findfirstfit to find fit in list
+	if (size > MAXPAYLOAD)		//does not fit next to the page header, use a page of its own
+	{
+		kma_page_t *page = get_page();
+		*((kma_page_t**) page->ptr) = page;
+		return (void *) ((long) page->ptr + sizeof(kma_page_t*));
+	}
+
+	//call findfit to find fit in the index
 	//if no fit can be found, allocate a new page
-	ret = findfirstfit(size);
+	ret = findfit(roundsize(size));
 	lheader *pageptr;
 
-	pageptr = (*(freeblockL *) ret).pageid;
+	pageptr = (lheader*) BASEADDR(ret);
 	((*pageptr).numalloc)++;		//increment number of allocated blocks on the page
-	return ret;
+	mainindex.numalloc++;
+	return (void *) ((long) ret + sizeof(long));	//skip the tag
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-	//addtofreelist ptr to list
-  addtofreelist(ptr, size);
-  //decrement number of allocated blocks on that page
-  (((lheader*)(((freeblockL*) ptr)->pageid))->numalloc)--;
-	//free a page if it has no allocated blocks
-	freeunalloc();
+	if (size > MAXPAYLOAD)
+	{
+		free_page(*((kma_page_t**) BASEADDR(ptr)));
+		return;
+	}
+	lheader *pageptr = (lheader*) BASEADDR(ptr);
+
+	//the tag knows the size of the block, coalesce it with its neighbours
+	addtofreelist((void *) ((long) ptr - sizeof(long)));
+	//decrement number of allocated blocks on that page
+	mainindex.numalloc--;
+	if (--((*pageptr).numalloc) == 0)
+	{
+		//the page is a single free block now that is not in the index,
+		//keep one such page around
+		if (mainindex.spare == NULL)
+			mainindex.spare = pageptr;
+		else
+			releasepage(pageptr);
+	}
+	//nothing allocated anymore, give the kept page back too
+	if (mainindex.numalloc == 0 && mainindex.spare != NULL)
+	{
+		releasepage(mainindex.spare);
+		mainindex.spare = NULL;
+	}
 }
 
 /*initialize page */
-void initial(kma_page_t *page, int first)
+void initial(kma_page_t *page)
 {
 	lheader *listheader;
+	freeblockL *block;
 	*((kma_page_t**) page->ptr) = page;	
 
 	listheader = (lheader*) (page->ptr); //set list header to base of page
 
-	//set header to right after initial data structure
-	listheader->header = (freeblockL*) ((long) listheader + sizeof(lheader));
-
-	if (first)
-		entryptr = page;
-	//add the page to the ll
-	addtofreelist(((void *) (listheader->header)), (PAGESIZE - sizeof(lheader)));
+	//the rest of the page is one free block, closed by a used tag
+	block = (freeblockL*) ((long) listheader + sizeof(lheader));
+	block->tag = 0;
+	*((long *) ((long) listheader + PAGESIZE) - 1) = 0;
+	insertblock(block, PAGEBLOCK);
 	(*listheader).numalloc = 0;
-	(*listheader).numpages = 0;
+	mainindex.numpages++;			//update number of pages
 
 	//return page;
 }
 
-/* return pointer to free space using first fit */
-void *findfirstfit(int size)
+/* requests take a tag and are at least a free block */
+int roundsize(int size)
 {
-	if (size < sizeof(freeblockL))
-		size = sizeof(freeblockL);	//min size allowed for rm
+	size += sizeof(long);
+	if (size < MINBLOCK)
+		size = MINBLOCK;	//min size allowed for rm
+	return (size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+}
 
-	lheader *mainpage;
-	mainpage = (lheader*)(entryptr->ptr);
-	freeblockL* temp = ((freeblockL *)(mainpage->header));
+/* return a block of size bytes using the configured policy */
+void *findfit(int size)
+{
+	freeblockL *temp;
 	int blocksize;
 
-	while (temp != NULL)
+#if RM_POLICY == RM_BESTFIT
+	temp = bestfit(size);
+#elif RM_POLICY == RM_NEXTFIT
+	temp = firstfitfrom(mainindex.addrroot, mainindex.rover, size);
+	if (temp == NULL)	//wrap around
+		temp = firstfitfrom(mainindex.addrroot, NULL, size);
+#else
+	temp = firstfitfrom(mainindex.addrroot, NULL, size);
+#endif
+
+	if (temp == NULL)
 	{
-		
-		blocksize = temp->size; //get a size
-
-		if (blocksize >= size)	//found the first fit
+		//didn't find fit, index the kept page or allocate a new one
+		if (mainindex.spare != NULL)
 		{
-			if (blocksize == size || (blocksize - size) < sizeof(freeblockL))
-			{
-				//perfect fit or not enough space left, remove from list and do not add new entry to reflect a free block
-				remove(temp);
-				return ((void *) temp);
-			}
-			//else, free space and make new entry in ll
-			addtofreelist((void *) ((long) temp + size), blocksize - size);
-			remove(temp);
-
-			return ((void *) temp);			
+			insertblock((freeblockL *) ((long) mainindex.spare + sizeof(lheader)), PAGEBLOCK);
+			mainindex.spare = NULL;
 		}
-		temp = temp->next;
+		else
+			initial(get_page());
+		//return new ptr
+		return findfit(size);
+	}
+
+	blocksize = BLOCKSIZE(temp);
+	remove(temp);
+	//keep the rest as a free block if it can hold a tree node
+	if ((blocksize - size) >= MINBLOCK)
+	{
+		freeblockL *rest = (freeblockL *) ((long) temp + size);
+		rest->tag = 0;
+		insertblock(rest, blocksize - size);
+	}
+	else
+	{
+		size = blocksize;
+		NEXTBLOCK(temp)->tag &= ~PREVFREE;
 	}
-	initial(get_page(), 0); 	//didn't find fit, allocate new page, add to ll
-	mainpage->numpages++;			//update number of pages
-	//return new ptr
-	return findfirstfit(size);
+	//a free block never follows another free block
+	temp->tag = size;
+	mainindex.rover = (void *) NEXTBLOCK(temp);
+
+	return ((void *) temp);
 }
 
-/* addtofreelists pointer to free space */
-void addtofreelist(void *ptr, int size)
+/* free a block, merging with the free blocks right before and after it;
+   a block that covers its whole page stays out of the index, so the page
+   can be released without touching the trees */
+void addtofreelist(void *ptr)
 {
-	lheader *mainpage;
-	mainpage = (lheader*)(entryptr->ptr);		//llheader/first page
+	freeblockL *block = (freeblockL *) ptr;
+	freeblockL *next = NEXTBLOCK(block);
+	int size = BLOCKSIZE(block);
 
-	void *temp = (void*)(mainpage->header);				//our ll
+	if (block->tag & PREVFREE)
+	{
+		block = (freeblockL *) ((long) block - *((long *) block - 1));
+		remove(block);
+		size += BLOCKSIZE(block);
+	}
+	if (next->tag & BLOCKFREE)
+	{
+		remove(next);
+		size += BLOCKSIZE(next);
+	}
+	if (size == PAGEBLOCK)
+		markblock(block, size);
+	else
+		insertblock(block, size);
+}
 
-	lheader *temppage;
-	long i = ((long) ptr - (long) mainpage) / PAGESIZE;		//how far our page is by num of pages
+/* free an empty page, its single free block is not in the index */
+void releasepage(lheader *page)
+{
+	assert(page->numalloc == 0);
+	assert(BLOCKSIZE((long) page + sizeof(lheader)) == PAGEBLOCK);
 
-	temppage = (lheader*)((long) mainpage + i * PAGESIZE);		//page we are addtofreelisting free resource to
-	(*(freeblockL*) ptr).pageid = temppage;
+	mainindex.numpages--;
+	free_page(page->self);
+}
 
+/* remove block from the index */
+void remove(void* ptr)
+{
+#if RM_ADDRINDEX
+	mainindex.addrroot = addrdelete(mainindex.addrroot, (freeblockL *) ptr);
+#endif
+	mainindex.sizeroot = sizedelete(mainindex.sizeroot, (freeblockL *) ptr);
+}
 
-	((freeblockL*)ptr)->size = size;		//set size of new block
-	((freeblockL*)ptr)->prev = NULL;
+/* mark block free, keeping the prev free bit */
+void markblock(freeblockL *block, int size)
+{
+	block->tag = size | BLOCKFREE | (block->tag & PREVFREE);
+	FOOTER(block) = size;
+	NEXTBLOCK(block)->tag |= PREVFREE;
+}
 
-	//if first entry
-	if (temp == ptr)
-	{
-		((freeblockL*)ptr)->next = NULL;
-	}
-	else if (temp > ptr)		//if new block comes before header
+/* mark block free and add it to the index */
+void insertblock(freeblockL *block, int size)
+{
+	markblock(block, size);
+	block->maxsize = size;
+	block->left = block->right = NULL;
+	block->sleft = block->sright = NULL;
+#if RM_ADDRINDEX
+	mainindex.addrroot = addrinsert(mainindex.addrroot, block);
+#endif
+	mainindex.sizeroot = sizeinsert(mainindex.sizeroot, block);
+}
+
+/* lowest addressed block at or after from that holds size, the maxsize of a subtree tells whether to go down there */
+freeblockL *firstfitfrom(freeblockL *node, void *from, int size)
+{
+	freeblockL *ret;
+
+	if (node == NULL || node->maxsize < size)
+		return NULL;
+	if ((void *) node < from)
+		return firstfitfrom(node->right, from, size);
+	ret = firstfitfrom(node->left, from, size);
+	if (ret)
+		return ret;
+	if (BLOCKSIZE(node) >= size)
+		return node;
+	return firstfitfrom(node->right, from, size);
+}
+
+/* smallest block that holds size, lowest address among equal sizes */
+freeblockL *bestfit(int size)
+{
+	freeblockL *temp = mainindex.sizeroot;
+	freeblockL *ret = NULL;
+
+	while (temp != NULL)
 	{
-		
-		int newblocksize = ((freeblockL*) ptr)->size;			//size fo block to be added
-		void* nextblock = (void *) ((long) ptr + newblocksize); //pointer to adjacent block of memory
-		//check if adjacent block is in list, coalesce blocks if it is
-		if ((nextblock == temp) && (((freeblockL*) nextblock)->pageid == ((freeblockL*)temp)->pageid))
-		{
-			if (((freeblockL*) (mainpage->header))->next == NULL)
-			{
-				((freeblockL* )ptr)->size += ((freeblockL*) (mainpage->header))->size;		
-				((freeblockL* )ptr)->next = NULL;						
-				mainpage->header = (freeblockL*)ptr;	//set header to new ptr							
-			}
-			else
-			{
-				freeblockL *newnext = ((freeblockL*) (mainpage->header))->next;
-				newnext->prev = ptr;
-				((freeblockL* )ptr)->next = newnext;
-				((freeblockL* )ptr)->size += ((freeblockL*) (mainpage->header))->size;			
-				mainpage->header = (freeblockL *)ptr;
-			}
-		}
-		else		//add block to list, set as new header
+		if (BLOCKSIZE(temp) >= size)
 		{
-			((freeblockL*) (mainpage->header))->prev = (freeblockL*)ptr;
-			((freeblockL*)ptr)->next = ((freeblockL*)(mainpage->header));
-			mainpage->header = (freeblockL*)ptr;	//set header to new ptr
+			ret = temp;
+			temp = temp->sleft;
 		}
+		else
+			temp = temp->sright;
 	}
-	else 
-	{	//else find where to add by searching the list
-		while (((freeblockL *)temp)->next)
-		{
-			if (temp > ptr)
-				break;
-			temp = ((void *)(((freeblockL*)temp)->next));
-		}
+	return ret;
+}
 
-		int blocksize = ((freeblockL*) temp)->size;	//size of block in list behind block to be added
-		void *nextblock = (void *) ((long) temp + blocksize);	//pointer to adjacent block of memory
+/* treap priorities are hashes of the block address, so they need no space */
+static unsigned int addrprio(freeblockL *node)
+{
+	return (unsigned int) (((unsigned long) node * 0x9E3779B97F4A7C15UL) >> 32);
+}
 
-		//if new block is next to old block, coalesce adjacent free blocks
-		if ((nextblock == ptr) && (((freeblockL*)nextblock)->pageid == ((freeblockL*)ptr)->pageid))
-		{
-			((freeblockL*) temp)->size = blocksize + ((freeblockL*)ptr)->size;
+static unsigned int sizeprio(freeblockL *node)
+{
+	return (unsigned int) (((unsigned long) node * 0xC2B2AE3D27D4EB4FUL) >> 32);
+}
+
+/* size order, ties broken by address */
+static int sizeless(freeblockL *a, freeblockL *b)
+{
+	return (BLOCKSIZE(a) < BLOCKSIZE(b)) || (BLOCKSIZE(a) == BLOCKSIZE(b) && a < b);
+}
+
+static void updatemax(freeblockL *node)
+{
+	node->maxsize = BLOCKSIZE(node);
+	if (node->left && node->left->maxsize > node->maxsize)
+		node->maxsize = node->left->maxsize;
+	if (node->right && node->right->maxsize > node->maxsize)
+		node->maxsize = node->right->maxsize;
+}
 
+freeblockL *addrinsert(freeblockL *root, freeblockL *node)
+{
+	freeblockL *child;
 
+	if (root == NULL)
+		return node;
+	if (node < root)
+	{
+		root->left = addrinsert(root->left, node);
+		if (addrprio(root->left) > addrprio(root))	//rotate right
+		{
+			child = root->left;
+			root->left = child->right;
+			updatemax(root);
+			child->right = root;
+			root = child;
 		}
-		else
+	}
+	else
+	{
+		root->right = addrinsert(root->right, node);
+		if (addrprio(root->right) > addrprio(root))	//rotate left
 		{
-			freeblockL *tempnext;
-			tempnext = ((freeblockL*)temp)->next;
-			//add to list
-			((freeblockL*)temp)->next = ptr;
-			((freeblockL*)ptr)->next = tempnext;
-			((freeblockL*)ptr)->prev = temp;
-			if (tempnext)
-				tempnext->prev = ptr;
+			child = root->right;
+			root->right = child->left;
+			updatemax(root);
+			child->left = root;
+			root = child;
 		}
 	}
+	updatemax(root);
+	return root;
 }
 
-/* looks for unallocated pages and frees them */
-void freeunalloc(void)
+/* join two address trees, everything in a lies below b */
+static freeblockL *addrjoin(freeblockL *a, freeblockL *b)
 {
-	lheader *mainpage;
-	mainpage = (lheader*)(entryptr->ptr);
-
-	lheader *temppage;
-	int i;
-	i = mainpage->numpages;	//find the last page, go there first
-	int cont = 0;		//keep searching or not
-	do
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (addrprio(a) > addrprio(b))
 	{
-		cont = 0;
-		temppage = (((lheader*)((long) mainpage + i * PAGESIZE)));		//get last page
-		freeblockL *temp = mainpage->header;		//get header to list
-		freeblockL *temp2;											//temp2 holds next entry in list
-		if (((lheader*)temppage)->numalloc == 0)		//if page has no allocs, first remove all pointers in list to that page
-		{
-			while (temp != NULL)
-			{
-				temp2 = temp->next;
-				if (temp->pageid == temppage)
-					remove(temp);
-				temp = temp2;
-			}
-			cont = 1; //check for additional pages
-			if (temppage == mainpage)		//if page is the main page, reset entryptr
-			{
-				entryptr = 0;
-				cont = 0;
-			}
-			free_page( (*temppage).self); //free page, decrement numpages if applicable
-			if (entryptr)
-				(mainpage->numpages)--;
-			i--;
-		}
-	} while(cont);
+		a->right = addrjoin(a->right, b);
+		updatemax(a);
+		return a;
+	}
+	b->left = addrjoin(a, b->left);
+	updatemax(b);
+	return b;
+}
 
+freeblockL *addrdelete(freeblockL *root, freeblockL *node)
+{
+	if (root == NULL)
+		return NULL;
+	if (root == node)
+		return addrjoin(root->left, root->right);
+	if (node < root)
+		root->left = addrdelete(root->left, node);
+	else
+		root->right = addrdelete(root->right, node);
+	updatemax(root);
+	return root;
 }
 
-/* remove pointer from list */
-void remove(void* ptr)
+freeblockL *sizeinsert(freeblockL *root, freeblockL *node)
 {
-	freeblockL* temp = (freeblockL*)ptr;
-	freeblockL* tempnext = temp->next;
-	freeblockL* tempprev = temp->prev;
+	freeblockL *child;
 
-	//just the header
-	if (tempnext == NULL && tempprev == NULL)
+	if (root == NULL)
+		return node;
+	if (sizeless(node, root))
 	{
-		lheader* mainpage = (lheader*)(entryptr->ptr);
-		mainpage->header = NULL;
-
-		entryptr = 0;
-		return;
+		root->sleft = sizeinsert(root->sleft, node);
+		if (sizeprio(root->sleft) > sizeprio(root))	//rotate right
+		{
+			child = root->sleft;
+			root->sleft = child->sright;
+			child->sright = root;
+			root = child;
+		}
 	}
-	//remove header from non empty list
-	if (tempprev == NULL)
+	else
 	{
-		lheader* mainpage = (lheader*)(entryptr->ptr);
-		tempnext->prev = NULL;
-		mainpage->header = tempnext;		//set as new header
-		return;
+		root->sright = sizeinsert(root->sright, node);
+		if (sizeprio(root->sright) > sizeprio(root))	//rotate left
+		{
+			child = root->sright;
+			root->sright = child->sleft;
+			child->sleft = root;
+			root = child;
+		}
 	}
+	return root;
+}
 
-	//tail of list
-	if (tempnext == NULL)
+/* join two size trees, everything in a sorts before b */
+static freeblockL *sizejoin(freeblockL *a, freeblockL *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (sizeprio(a) > sizeprio(b))
 	{
-		tempprev->next = NULL;
-		return;
+		a->sright = sizejoin(a->sright, b);
+		return a;
 	}
-	//any other part in list
-	tempnext->prev = tempprev;
-	tempprev->next = tempnext;
-	return;
+	b->sleft = sizejoin(a, b->sleft);
+	return b;
+}
+
+freeblockL *sizedelete(freeblockL *root, freeblockL *node)
+{
+	if (root == NULL)
+		return NULL;
+	if (root == node)
+		return sizejoin(root->sleft, root->sright);
+	if (sizeless(node, root))
+		root->sleft = sizedelete(root->sleft, node);
+	else
+		root->sright = sizedelete(root->sright, node);
+	return root;
 }
 
 #endif // KMA_RM
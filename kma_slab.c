@@ -0,0 +1,426 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on slab object caches
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+#define __KSLAB_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_slab.h"
+#include "kma_arena.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// slabs are colored in steps of a cache line
+#define CACHELINE 64
+
+// kma_malloc serves requests up to MAXOBJSIZE from power-of-two caches
+#define MINOBJSIZE 16
+#define NUMCLASSES 8
+#define MAXOBJSIZE (MINOBJSIZE << (NUMCLASSES - 1))
+
+#define ROUNDUP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+// a slab is one page, its header sits at the end of the page
+typedef struct slab
+{
+  kma_page_t*    page;    // the descriptor returned by get_page()
+  kmem_cache_t*  cache;   // the cache owning this slab
+  struct slab*   prev;    // neighbours in the full, partial or empty list
+  struct slab*   next;
+  void*          freeobj; // first free object
+  int            inuse;   // objects handed out from this slab
+} slab_t;
+
+#define SLABOF(obj) ((slab_t*)(BASEADDR(obj) + PAGESIZE - sizeof(slab_t)))
+
+struct kmem_cache
+{
+  char*            name;
+  kma_size_t       size;      // object size as requested
+  kma_size_t       bufsize;   // distance between two objects
+  kma_size_t       linkoff;   // where a free object keeps its free list link
+  kma_size_t       align;
+  int              perslab;   // objects per slab
+  int              maxcolor;  // largest color offset
+  int              nextcolor; // color offset of the next slab
+  kmem_cache_fn_t  ctor;
+  kmem_cache_fn_t  dtor;
+  slab_t*          full;      // slabs without free objects
+  slab_t*          partial;   // slabs with free and used objects
+  slab_t*          empty;     // slabs without used objects
+  int              numempty;
+};
+
+/************Global Variables*********************************************/
+
+// cache descriptors come from a cache of their own, every arena has
+// its caches, the macros pick the calling thread's
+static kmem_cache_t gCacheCaches[NUMARENAS] =
+  {
+    [0 ... NUMARENAS - 1] =
+    {
+      "kmem_cache", sizeof(kmem_cache_t), ROUNDUP(sizeof(kmem_cache_t), sizeof(void*)),
+      0, sizeof(void*), 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0
+    }
+  };
+#define gCacheCache gCacheCaches[kma_arena]
+
+static kmem_cache_t* gSizeCaches[NUMARENAS][NUMCLASSES];
+#define gSizeCache gSizeCaches[kma_arena]
+static char* kSizeCacheName[NUMCLASSES] =
+  {
+    "kma_malloc-16", "kma_malloc-32", "kma_malloc-64", "kma_malloc-128",
+    "kma_malloc-256", "kma_malloc-512", "kma_malloc-1024", "kma_malloc-2048"
+  };
+static int gNumAllocs[NUMARENAS];
+#define gNumAlloc gNumAllocs[kma_arena]
+
+/************Function Prototypes******************************************/
+
+static void setupCache(kmem_cache_t* cache);
+static slab_t* growCache(kmem_cache_t* cache);
+static void destroySlab(kmem_cache_t* cache, slab_t* slab);
+static void linkSlab(slab_t** list, slab_t* slab);
+static void unlinkSlab(slab_t** list, slab_t* slab);
+static int findClass(kma_size_t size);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int i;
+  
+  if ((size + sizeof(void*)) > PAGESIZE)
+    { // requested size too large
+      return NULL;
+    }
+  
+  gNumAlloc++;
+  
+  if (size > MAXOBJSIZE)
+    { // large requests get a page of their own, tagged with its descriptor
+      kma_page_t* page = get_page();
+      
+      *((kma_page_t**)page->ptr) = page;
+      return page->ptr + sizeof(kma_page_t*);
+    }
+  
+  i = findClass(size);
+  if (gSizeCache[i] == NULL)
+    {
+      gSizeCache[i] = kmem_cache_create(kSizeCacheName[i], MINOBJSIZE << i,
+					0, NULL, NULL);
+    }
+  
+  return kmem_cache_alloc(gSizeCache[i]);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  int i;
+  
+  assert(gNumAlloc > 0);
+  
+  if (size > MAXOBJSIZE)
+    {
+      free_page(*((kma_page_t**)(ptr - sizeof(kma_page_t*))));
+    }
+  else
+    {
+      kmem_cache_free(gSizeCache[findClass(size)], ptr);
+    }
+  
+  if (--gNumAlloc == 0)
+    { // tear the caches down so every page goes back
+      for (i = 0; i < NUMCLASSES; i++)
+	{
+	  if (gSizeCache[i] != NULL)
+	    {
+	      kmem_cache_destroy(gSizeCache[i]);
+	      gSizeCache[i] = NULL;
+	    }
+	}
+      kmem_cache_reap(&gCacheCache);
+    }
+}
+
+kmem_cache_t*
+kmem_cache_create(char* name, kma_size_t size, kma_size_t align,
+		  kmem_cache_fn_t ctor, kmem_cache_fn_t dtor)
+{
+  kmem_cache_t* cache;
+  
+  if (align <= 0)
+    {
+      align = sizeof(void*);
+    }
+  assert((align & (align - 1)) == 0);
+  
+  if (ROUNDUP(size, align) + sizeof(void*) > PAGESIZE - sizeof(slab_t))
+    {
+      return NULL;
+    }
+  
+  if (gCacheCache.perslab == 0)
+    {
+      setupCache(&gCacheCache);
+    }
+  
+  cache = (kmem_cache_t*)kmem_cache_alloc(&gCacheCache);
+  cache->name = name;
+  cache->size = size;
+  cache->align = align;
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+  cache->full = NULL;
+  cache->partial = NULL;
+  cache->empty = NULL;
+  cache->numempty = 0;
+  
+  if (ctor == NULL && size >= sizeof(void*))
+    { // nothing to preserve, keep the link inside the object
+      cache->bufsize = ROUNDUP(size, align);
+      cache->linkoff = 0;
+    }
+  else
+    { // keep the link behind the object so its constructed state survives
+      cache->linkoff = ROUNDUP(size, sizeof(void*));
+      cache->bufsize = ROUNDUP(cache->linkoff + sizeof(void*), align);
+    }
+  setupCache(cache);
+  
+  return cache;
+}
+
+void*
+kmem_cache_alloc(kmem_cache_t* cache)
+{
+  slab_t* slab = cache->partial;
+  void* obj;
+  
+  if (slab == NULL)
+    {
+      slab = cache->empty;
+      if (slab != NULL)
+	{
+	  unlinkSlab(&cache->empty, slab);
+	  cache->numempty--;
+	}
+      else
+	{
+	  slab = growCache(cache);
+	}
+      linkSlab(&cache->partial, slab);
+    }
+  
+  obj = slab->freeobj;
+  slab->freeobj = *((void**)(obj + cache->linkoff));
+  slab->inuse++;
+  
+  if (slab->freeobj == NULL)
+    {
+      unlinkSlab(&cache->partial, slab);
+      linkSlab(&cache->full, slab);
+    }
+  
+  return obj;
+}
+
+void
+kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+  slab_t* slab = SLABOF(obj);
+  
+  assert(slab->cache == cache);
+  assert(slab->inuse > 0);
+  
+  if (slab->freeobj == NULL)
+    {
+      unlinkSlab(&cache->full, slab);
+      linkSlab(&cache->partial, slab);
+    }
+  
+  *((void**)(obj + cache->linkoff)) = slab->freeobj;
+  slab->freeobj = obj;
+  slab->inuse--;
+  
+  if (slab->inuse == 0)
+    {
+      unlinkSlab(&cache->partial, slab);
+      if (cache->numempty == 0)
+	{ // keep one empty slab to absorb churn
+	  linkSlab(&cache->empty, slab);
+	  cache->numempty++;
+	}
+      else
+	{
+	  destroySlab(cache, slab);
+	}
+    }
+}
+
+void
+kmem_cache_reap(kmem_cache_t* cache)
+{
+  while (cache->empty != NULL)
+    {
+      slab_t* slab = cache->empty;
+      
+      unlinkSlab(&cache->empty, slab);
+      destroySlab(cache, slab);
+    }
+  cache->numempty = 0;
+}
+
+void
+kmem_cache_destroy(kmem_cache_t* cache)
+{
+  assert(cache->full == NULL && cache->partial == NULL);
+  
+  kmem_cache_reap(cache);
+  kmem_cache_free(&gCacheCache, cache);
+  
+  // like kma_free, give every page back once nothing is allocated
+  if (gNumAlloc == 0)
+    {
+      kmem_cache_reap(&gCacheCache);
+    }
+}
+
+// work out how many objects fit into a slab and how many colors are left
+static void
+setupCache(kmem_cache_t* cache)
+{
+  int usable = PAGESIZE - sizeof(slab_t);
+  int step = cache->align > CACHELINE ? cache->align : CACHELINE;
+  
+  cache->perslab = usable / cache->bufsize;
+  cache->maxcolor = (usable - cache->perslab * cache->bufsize) / step * step;
+  cache->nextcolor = 0;
+}
+
+// add a slab, shifting its objects by the next color offset
+static slab_t*
+growCache(kmem_cache_t* cache)
+{
+  kma_page_t* page = get_page();
+  slab_t* slab = SLABOF(page->ptr);
+  int step = cache->align > CACHELINE ? cache->align : CACHELINE;
+  void* obj;
+  int i;
+  
+  slab->page = page;
+  slab->cache = cache;
+  slab->prev = NULL;
+  slab->next = NULL;
+  slab->inuse = 0;
+  
+  obj = page->ptr + cache->nextcolor;
+  cache->nextcolor += step;
+  if (cache->nextcolor > cache->maxcolor)
+    {
+      cache->nextcolor = 0;
+    }
+  
+  slab->freeobj = obj;
+  for (i = 0; i < cache->perslab; i++, obj += cache->bufsize)
+    {
+      if (cache->ctor != NULL)
+	{
+	  cache->ctor(obj, cache->size);
+	}
+      *((void**)(obj + cache->linkoff)) =
+	(i == cache->perslab - 1) ? NULL : obj + cache->bufsize;
+    }
+  
+  return slab;
+}
+
+// destruct the objects of an empty slab and give its page back
+static void
+destroySlab(kmem_cache_t* cache, slab_t* slab)
+{
+  assert(slab->inuse == 0);
+  
+  if (cache->dtor != NULL)
+    {
+      void* obj;
+      void* next;
+      
+      // the link may sit inside the object, so read it before the
+      // destructor gets to write there
+      for (obj = slab->freeobj; obj != NULL; obj = next)
+	{
+	  next = *((void**)(obj + cache->linkoff));
+	  cache->dtor(obj, cache->size);
+	}
+    }
+  
+  free_page(slab->page);
+}
+
+static void
+linkSlab(slab_t** list, slab_t* slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    {
+      (*list)->prev = slab;
+    }
+  *list = slab;
+}
+
+static void
+unlinkSlab(slab_t** list, slab_t* slab)
+{
+  if (slab->prev != NULL)
+    {
+      slab->prev->next = slab->next;
+    }
+  else
+    {
+      *list = slab->next;
+    }
+  if (slab->next != NULL)
+    {
+      slab->next->prev = slab->prev;
+    }
+  slab->prev = NULL;
+  slab->next = NULL;
+}
+
+// map a request to the smallest power-of-two cache holding it
+static int
+findClass(kma_size_t size)
+{
+  int i = 0;
+  kma_size_t objsize = MINOBJSIZE;
+  
+  while (objsize < size)
+    {
+      objsize <<= 1;
+      i++;
+    }
+  return i;
+}
+
+#endif // KMA_SLAB
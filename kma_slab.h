@@ -0,0 +1,128 @@
+/***************************************************************************
+ *  Title: Kernel Object Cache Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the slab object caches
+ ***************************************************************************/
+
+#ifndef __KSLAB_H__
+#define __KSLAB_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KSLAB_IMPL__
+#define EXTERN 
+#else
+#define EXTERN extern
+#endif
+
+typedef struct kmem_cache kmem_cache_t;
+
+// constructors and destructors get the object and the object size
+typedef void (*kmem_cache_fn_t)(void*, kma_size_t);
+
+// in the concurrent build the calls below come from the arenas, which
+// lock the arena of the cache and call the engine under these names
+#if defined(__KSLAB_IMPL__) && defined(KMA_CONCURRENT)
+#define kmem_cache_create engine_cache_create
+#define kmem_cache_alloc engine_cache_alloc
+#define kmem_cache_free engine_cache_free
+#define kmem_cache_reap engine_cache_reap
+#define kmem_cache_destroy engine_cache_destroy
+#endif
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates a cache handing out objects of a fixed size.
+ *             Objects are constructed once when their slab is created
+ *             and destructed when the slab goes back to the page
+ *             allocator, so freed objects keep their constructed state
+ *    Input: the name of the cache (not copied), the object size, the
+ *           object alignment (0 for pointer alignment), the
+ *           constructor and the destructor (both may be NULL)
+ *    Output: the cache or NULL if the objects do not fit into a page
+ ***********************************************************************/
+EXTERN kmem_cache_t* kmem_cache_create(char* name, kma_size_t size,
+				       kma_size_t align,
+				       kmem_cache_fn_t ctor,
+				       kmem_cache_fn_t dtor);
+
+/***********************************************************************
+ *  Title: Allocates an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a constructed object from a cache
+ *    Input: the cache
+ *    Output: the object
+ ***********************************************************************/
+EXTERN void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/***********************************************************************
+ *  Title: Frees an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns an object to its cache, the object must be in
+ *             its constructed state again
+ *    Input: the cache, the object
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+/***********************************************************************
+ *  Title: Releases empty slabs
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives every empty slab of a cache back to the page
+ *             allocator
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kmem_cache_reap(kmem_cache_t* cache);
+
+/***********************************************************************
+ *  Title: Destroys an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases all slabs and the cache itself, no object of
+ *             the cache may be in use
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kmem_cache_destroy(kmem_cache_t* cache);
+
+#ifdef KMA_CONCURRENT
+/***********************************************************************
+ *  Title: Engine object cache calls
+ * ---------------------------------------------------------------------
+ *    Purpose: The calls above as the slab engine implements them,
+ *             which the arenas make with the arena of the cache locked
+ *             and kma_arena set
+ *    Input: as above
+ *    Output: as above
+ ***********************************************************************/
+EXTERN kmem_cache_t* engine_cache_create(char* name, kma_size_t size,
+					 kma_size_t align,
+					 kmem_cache_fn_t ctor,
+					 kmem_cache_fn_t dtor);
+EXTERN void* engine_cache_alloc(kmem_cache_t* cache);
+EXTERN void engine_cache_free(kmem_cache_t* cache, void* obj);
+EXTERN void engine_cache_reap(kmem_cache_t* cache);
+EXTERN void engine_cache_destroy(kmem_cache_t* cache);
+#endif
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KSLAB_H__ */
@@ -0,0 +1,432 @@
+/***************************************************************************
+ *  Title: Stress test
+ * -------------------------------------------------------------------------
+ *    Purpose: Runs kma_malloc() and kma_free() of a concurrent build from
+ *             several threads and checks that every page comes back
+ ***************************************************************************/
+#ifndef KMA_CONCURRENT
+#error "the stress test needs KMA_CONCURRENT"
+#endif
+
+/************System include***********************************************/
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_arena.h"
+#include "kma_magazine.h"
+#ifdef KMA_SLAB
+#include "kma_slab.h"
+#endif
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// every round starts PAIRS producers that only allocate, PAIRS
+// consumers that only free what their producer hands them, and
+// CHURNERS threads that allocate and free in a table they share
+#define ROUNDS 20
+#define PAIRS 4
+#define CHURNERS 4
+
+#define ITEMS 20000    // buffers every producer hands over
+#define OPS 50000      // operations of every churner
+#define SLOTS 4096     // buffers in the shared table
+#define QUEUESIZE 256  // buffers in flight from a producer
+#define OBJSIZE 96     // objects of the shared object cache
+
+typedef struct
+{
+  void*  ptr;
+  int    size;
+} item_t;
+
+// a producer hands its buffers to its consumer through a ring, a NULL
+// buffer ends the round
+typedef struct
+{
+  pthread_mutex_t  lock;
+  pthread_cond_t   changed;
+  item_t           ring[QUEUESIZE];
+  int              head;
+  int              count;
+} queue_t;
+
+typedef struct
+{
+  int    lock;
+  void*  ptr;
+  int    size;
+} slot_t;
+
+/************Global Variables*********************************************/
+
+static queue_t gQueue[PAIRS];
+static slot_t gSlot[SLOTS];
+
+#ifdef KMA_SLAB
+// an object cache all churners allocate from and free to, a slot with
+// size 0 holds one of its objects
+static kmem_cache_t* gShared;
+#endif
+
+/************Function Prototypes******************************************/
+static void* produce(void* arg);
+static void* consume(void* arg);
+static void* churn(void* arg);
+static void* cleanUp(void* arg);
+static void grab(slot_t* slot, unsigned int* seed);
+static void release(slot_t* slot);
+#ifdef KMA_SLAB
+static void* createShared(void* arg);
+static void* destroyShared(void* arg);
+static void construct(void* obj, kma_size_t size);
+static void destruct(void* obj, kma_size_t size);
+#endif
+#ifdef KMA_MAGAZINE
+static void* reap(void* arg);
+#endif
+static void runThread(void* (*fn)(void*), void* arg);
+static void fill(void* ptr, int size);
+static void check(void* ptr, int size);
+static int randomSize(unsigned int* seed);
+static void put(queue_t* queue, void* ptr, int size);
+static item_t take(queue_t* queue);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t thread[2 * PAIRS + CHURNERS];
+  kma_page_stat_t* stat;
+  long i, round;
+
+  for (i = 0; i < PAIRS; i++)
+    {
+      pthread_mutex_init(&gQueue[i].lock, NULL);
+      pthread_cond_init(&gQueue[i].changed, NULL);
+    }
+
+  for (round = 0; round < ROUNDS; round++)
+    {
+#ifdef KMA_SLAB
+      runThread(createShared, NULL);
+#endif
+      for (i = 0; i < PAIRS; i++)
+	{
+	  pthread_create(&thread[2 * i], NULL, produce,
+			 (void*)(round * PAIRS + i));
+	  pthread_create(&thread[2 * i + 1], NULL, consume, &gQueue[i]);
+	}
+      for (i = 0; i < CHURNERS; i++)
+	{
+	  pthread_create(&thread[2 * PAIRS + i], NULL, churn,
+			 (void*)(round * CHURNERS + i));
+	}
+      for (i = 0; i < 2 * PAIRS + CHURNERS; i++)
+	{
+	  pthread_join(thread[i], NULL);
+	}
+
+      // the main thread never calls the allocator, so that it keeps no
+      // magazines of its own: the threads that free the rest exit too
+      runThread(cleanUp, NULL);
+#ifdef KMA_SLAB
+      runThread(destroyShared, NULL);
+#endif
+#ifdef KMA_MAGAZINE
+      runThread(reap, NULL);
+#endif
+
+      // with all threads gone the pages in use are back to none, and
+      // the only pages still marked are the ones on the free stack
+      stat = page_stats();
+      if (stat->num_in_use != 0 || stat->num_requested != stat->num_freed)
+	{
+	  error("pages still in use after a round", "");
+	}
+      if (stat->num_marked != stat->num_stacked)
+	{
+	  error("pages still marked after a round", "");
+	}
+
+      // a trim gives the stack back to the bitmap as well
+      kma_page_trim();
+      stat = page_stats();
+      if (stat->num_marked != 0 || stat->num_stacked != 0)
+	{
+	  error("pages still marked after a trim", "");
+	}
+    }
+
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested, stat->num_freed, stat->num_in_use);
+  printf("Page Marked/Stacked: %d/%d\n", stat->num_marked, stat->num_stacked);
+  printf("Page Magazine Refills/Flushes: %d/%d\n",
+	 stat->num_refills, stat->num_flushes);
+  printf("Test: PASS\n");
+
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  printf("%s %s\n", message, arg);
+  printf("Test: FAIL\n");
+  exit(1);
+}
+
+// allocate ITEMS buffers and hand them to the consumer of the pair
+static void*
+produce(void* arg)
+{
+  unsigned int seed = (long)arg;
+  queue_t* queue = &gQueue[(long)arg % PAIRS];
+  int i;
+
+  for (i = 0; i < ITEMS; i++)
+    {
+      int size = randomSize(&seed);
+      void* ptr = kma_malloc(size);
+
+      if (ptr == NULL)
+	{
+	  error("producer out of memory", "");
+	}
+      fill(ptr, size);
+      put(queue, ptr, size);
+    }
+  put(queue, NULL, 0);
+
+  return NULL;
+}
+
+// free what the producer hands over, so every free is remote and the
+// thread exits with full magazines
+static void*
+consume(void* arg)
+{
+  queue_t* queue = arg;
+  item_t item;
+
+  while ((item = take(queue)).ptr != NULL)
+    {
+      check(item.ptr, item.size);
+      kma_free(item.ptr, item.size);
+    }
+
+  return NULL;
+}
+
+// free the buffer of a random slot or allocate one into it, the
+// buffers are freed by whichever thread comes along
+static void*
+churn(void* arg)
+{
+  unsigned int seed = (long)arg + ROUNDS * PAIRS;
+  int i;
+
+  for (i = 0; i < OPS; i++)
+    {
+      slot_t* slot = &gSlot[rand_r(&seed) % SLOTS];
+
+      while (__atomic_exchange_n(&slot->lock, 1, __ATOMIC_ACQUIRE))
+	;
+      if (slot->ptr != NULL)
+	{
+	  release(slot);
+	}
+      else
+	{
+	  grab(slot, &seed);
+	}
+      __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+    }
+
+  return NULL;
+}
+
+// free what the churners left in the table
+static void*
+cleanUp(void* arg)
+{
+  int i;
+
+  for (i = 0; i < SLOTS; i++)
+    {
+      if (gSlot[i].ptr != NULL)
+	{
+	  release(&gSlot[i]);
+	}
+    }
+
+  return NULL;
+}
+
+// put a new buffer into a slot, with KMA_SLAB one in four is an object
+// of the shared cache
+static void
+grab(slot_t* slot, unsigned int* seed)
+{
+#ifdef KMA_SLAB
+  if (rand_r(seed) % 4 == 0)
+    {
+      slot->size = 0;
+      slot->ptr = kmem_cache_alloc(gShared);
+      // the constructor wrote the pattern, and freed objects keep it
+      check(slot->ptr, OBJSIZE);
+      return;
+    }
+#endif
+  slot->size = randomSize(seed);
+  slot->ptr = kma_malloc(slot->size);
+  if (slot->ptr == NULL)
+    {
+      error("churner out of memory", "");
+    }
+  fill(slot->ptr, slot->size);
+}
+
+// free the buffer of a slot
+static void
+release(slot_t* slot)
+{
+#ifdef KMA_SLAB
+  if (slot->size == 0)
+    {
+      check(slot->ptr, OBJSIZE);
+      kmem_cache_free(gShared, slot->ptr);
+      slot->ptr = NULL;
+      return;
+    }
+#endif
+  check(slot->ptr, slot->size);
+  kma_free(slot->ptr, slot->size);
+  slot->ptr = NULL;
+}
+
+#ifdef KMA_SLAB
+static void*
+createShared(void* arg)
+{
+  gShared = kmem_cache_create("shared", OBJSIZE, 0, construct, destruct);
+
+  return NULL;
+}
+
+static void*
+destroyShared(void* arg)
+{
+  kmem_cache_destroy(gShared);
+
+  return NULL;
+}
+
+// the constructor fills the pattern in, the destructor expects it still
+static void
+construct(void* obj, kma_size_t size)
+{
+  fill(obj, size);
+}
+
+static void
+destruct(void* obj, kma_size_t size)
+{
+  check(obj, size);
+}
+#endif
+
+#ifdef KMA_MAGAZINE
+// give the buffers in the depot back to the engine
+static void*
+reap(void* arg)
+{
+  kma_magazine_reap();
+
+  return NULL;
+}
+#endif
+
+// run fn in a thread of its own and wait for it
+static void
+runThread(void* (*fn)(void*), void* arg)
+{
+  pthread_t thread;
+
+  pthread_create(&thread, NULL, fn, arg);
+  pthread_join(thread, NULL);
+}
+
+// write a pattern into a buffer that check() expects
+static void
+fill(void* ptr, int size)
+{
+  memset(ptr, (long)ptr ^ size, size);
+}
+
+static void
+check(void* ptr, int size)
+{
+  unsigned char* byte = ptr;
+  int i;
+
+  for (i = 0; i < size; i++)
+    {
+      if (byte[i] != (unsigned char)((long)ptr ^ size))
+	{
+	  error("buffer overwritten", "");
+	}
+    }
+}
+
+// mostly small buffers, one in four up to 3000 bytes
+static int
+randomSize(unsigned int* seed)
+{
+  return 1 + rand_r(seed) % (rand_r(seed) % 4 ? 200 : 3000);
+}
+
+static void
+put(queue_t* queue, void* ptr, int size)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == QUEUESIZE)
+    {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+  queue->ring[(queue->head + queue->count++) % QUEUESIZE] =
+    (item_t) { ptr, size };
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static item_t
+take(queue_t* queue)
+{
+  item_t item;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0)
+    {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+  item = queue->ring[queue->head];
+  queue->head = (queue->head + 1) % QUEUESIZE;
+  queue->count--;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+
+  return item;
+}
@@ -0,0 +1,353 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the two-level segregated
+ *             fit (TLSF) algorithm
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_arena.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// block sizes count the header and are multiples of ALIGNSIZE
+#define ALIGNSIZE 16
+#define HDRSIZE sizeof(long)
+
+// a free block holds its header, two list links and its footer
+#define MINBLKSIZE 32
+
+// the second level splits every power of two into SLCOUNT lists
+#define SLCOUNT_LOG2 4
+#define SLCOUNT (1 << SLCOUNT_LOG2)
+
+// blocks below SMALLBLOCK all go to the first level list 0
+#define FLSHIFT (SLCOUNT_LOG2 + 4)
+#define SMALLBLOCK (1 << FLSHIFT)
+
+// a page starts with its descriptor and ends with a used sentinel header
+#define FIRSTBLOCK sizeof(kma_page_t*)
+#define PAGEBLOCK (PAGESIZE - FIRSTBLOCK - HDRSIZE)
+#define PAGEBLOCK_LOG2 (31 - __builtin_clz(PAGEBLOCK))
+
+#define FLCOUNT (PAGEBLOCK_LOG2 - FLSHIFT + 2)
+
+// the good fit search rounds up to the next list, so only blocks up to
+// the start of the list holding a whole page are served from pages
+#define MAXBLOCK (PAGEBLOCK & ~((1 << (PAGEBLOCK_LOG2 - SLCOUNT_LOG2)) - 1))
+#define MAXPAYLOAD (MAXBLOCK - HDRSIZE)
+
+// flags kept in the low bits of the size field
+#define BLOCKFREE 1
+#define PREVFREE 2
+#define SIZEMASK (~(long)(ALIGNSIZE - 1))
+
+typedef struct block
+{
+  long           size;     // block size and flags, the boundary tag
+  struct block*  nextfree; // list links, only valid while free
+  struct block*  prevfree;
+} block_t;
+
+#define BLOCKSIZE(b) ((b)->size & SIZEMASK)
+#define NEXTBLOCK(b) ((block_t*)((void*)(b) + BLOCKSIZE(b)))
+#define FOOTER(b) (*((long*)((void*)NEXTBLOCK(b) - sizeof(long))))
+
+typedef struct
+{
+  unsigned int  flmap;                    // first levels with a free block
+  unsigned int  slmap[FLCOUNT];           // second levels with a free block
+  block_t*      blocks[FLCOUNT][SLCOUNT]; // free lists
+} tlsf_t;
+
+/************Global Variables*********************************************/
+
+// one set of lists per arena, the macros pick the calling thread's
+static tlsf_t gTlsfs[NUMARENAS];
+static block_t* gSpares[NUMARENAS];
+static int gNumAllocs[NUMARENAS];
+#define gTlsf gTlsfs[kma_arena]
+#define gSpare gSpares[kma_arena]
+#define gNumAlloc gNumAllocs[kma_arena]
+
+/************Function Prototypes******************************************/
+
+static void mappingInsert(long size, int* fl, int* sl);
+static void mappingSearch(long size, int* fl, int* sl);
+static block_t* findSuitable(int* fl, int* sl);
+static void insertBlock(block_t* blk);
+static void removeBlock(block_t* blk);
+static void markFree(block_t* blk);
+static void addPage();
+static void releasePage(block_t* blk);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  block_t* blk;
+  long bsize;
+  int fl, sl;
+  
+  if ((size + sizeof(void*)) > PAGESIZE)
+    { // requested size too large
+      return NULL;
+    }
+  
+  gNumAlloc++;
+  
+  if (size > MAXPAYLOAD)
+    { // does not fit next to the page bookkeeping, use a page of its own
+      kma_page_t* page = get_page();
+      
+      *((kma_page_t**)page->ptr) = page;
+      return page->ptr + sizeof(kma_page_t*);
+    }
+  
+  bsize = (size + HDRSIZE + ALIGNSIZE - 1) & SIZEMASK;
+  if (bsize < MINBLKSIZE)
+    {
+      bsize = MINBLKSIZE;
+    }
+  
+  mappingSearch(bsize, &fl, &sl);
+  blk = findSuitable(&fl, &sl);
+  if (blk == NULL)
+    {
+      addPage();
+      mappingSearch(bsize, &fl, &sl);
+      blk = findSuitable(&fl, &sl);
+    }
+  assert(blk != NULL && BLOCKSIZE(blk) >= bsize);
+  
+  removeBlock(blk);
+  if (blk == gSpare)
+    {
+      gSpare = NULL;
+    }
+  
+  if (BLOCKSIZE(blk) - bsize >= MINBLKSIZE)
+    { // split off the rest, it stays in front of a free block
+      block_t* rest = (block_t*)((void*)blk + bsize);
+      
+      rest->size = BLOCKSIZE(blk) - bsize;
+      blk->size = bsize | (blk->size & PREVFREE);
+      markFree(rest);
+      insertBlock(rest);
+    }
+  else
+    {
+      NEXTBLOCK(blk)->size &= ~PREVFREE;
+    }
+  blk->size &= ~BLOCKFREE;
+  
+  return (void*)blk + HDRSIZE;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  block_t* blk = (block_t*)(ptr - HDRSIZE);
+  block_t* next;
+  
+  assert(gNumAlloc > 0);
+  gNumAlloc--;
+  
+  if (size > MAXPAYLOAD)
+    {
+      free_page(*((kma_page_t**)(ptr - sizeof(kma_page_t*))));
+    }
+  else
+    {
+      assert(!(blk->size & BLOCKFREE));
+      
+      // the boundary tags give both neighbours in O(1)
+      if (blk->size & PREVFREE)
+	{
+	  block_t* prev = (block_t*)((void*)blk - *((long*)blk - 1));
+	  
+	  removeBlock(prev);
+	  prev->size += BLOCKSIZE(blk);
+	  blk = prev;
+	}
+      next = NEXTBLOCK(blk);
+      if (next->size & BLOCKFREE)
+	{
+	  removeBlock(next);
+	  blk->size += BLOCKSIZE(next);
+	}
+      
+      markFree(blk);
+      insertBlock(blk);
+      
+      if (BLOCKSIZE(blk) == PAGEBLOCK)
+	{ // the whole page is free, keep one page against churn
+	  if (gSpare == NULL)
+	    {
+	      gSpare = blk;
+	    }
+	  else
+	    {
+	      releasePage(blk);
+	    }
+	}
+    }
+  
+  if (gNumAlloc == 0 && gSpare != NULL)
+    {
+      releasePage(gSpare);
+      gSpare = NULL;
+    }
+}
+
+// list indices of a block size
+static void
+mappingInsert(long size, int* fl, int* sl)
+{
+  if (size < SMALLBLOCK)
+    {
+      *fl = 0;
+      *sl = size / (SMALLBLOCK / SLCOUNT);
+    }
+  else
+    {
+      int bit = 31 - __builtin_clz(size);
+      
+      *sl = (size >> (bit - SLCOUNT_LOG2)) ^ SLCOUNT;
+      *fl = bit - FLSHIFT + 1;
+    }
+}
+
+// list indices from which every block is large enough for size
+static void
+mappingSearch(long size, int* fl, int* sl)
+{
+  if (size >= SMALLBLOCK)
+    {
+      size += (1 << (31 - __builtin_clz(size) - SLCOUNT_LOG2)) - 1;
+    }
+  mappingInsert(size, fl, sl);
+}
+
+// first non-empty list at or above (fl, sl), two find-first-set lookups
+static block_t*
+findSuitable(int* fl, int* sl)
+{
+  unsigned int slmap;
+  unsigned int flmap;
+  
+  if (*fl >= FLCOUNT)
+    {
+      return NULL;
+    }
+  
+  slmap = gTlsf.slmap[*fl] & (~0U << *sl);
+  if (slmap == 0)
+    {
+      flmap = gTlsf.flmap & (~0U << (*fl + 1));
+      if (flmap == 0)
+	{
+	  return NULL;
+	}
+      *fl = __builtin_ctz(flmap);
+      slmap = gTlsf.slmap[*fl];
+    }
+  *sl = __builtin_ctz(slmap);
+  
+  return gTlsf.blocks[*fl][*sl];
+}
+
+static void
+insertBlock(block_t* blk)
+{
+  int fl, sl;
+  
+  mappingInsert(BLOCKSIZE(blk), &fl, &sl);
+  blk->prevfree = NULL;
+  blk->nextfree = gTlsf.blocks[fl][sl];
+  if (blk->nextfree != NULL)
+    {
+      blk->nextfree->prevfree = blk;
+    }
+  gTlsf.blocks[fl][sl] = blk;
+  gTlsf.flmap |= 1U << fl;
+  gTlsf.slmap[fl] |= 1U << sl;
+}
+
+static void
+removeBlock(block_t* blk)
+{
+  int fl, sl;
+  
+  mappingInsert(BLOCKSIZE(blk), &fl, &sl);
+  if (blk->prevfree != NULL)
+    {
+      blk->prevfree->nextfree = blk->nextfree;
+    }
+  else
+    {
+      gTlsf.blocks[fl][sl] = blk->nextfree;
+      if (blk->nextfree == NULL)
+	{
+	  gTlsf.slmap[fl] &= ~(1U << sl);
+	  if (gTlsf.slmap[fl] == 0)
+	    {
+	      gTlsf.flmap &= ~(1U << fl);
+	    }
+	}
+    }
+  if (blk->nextfree != NULL)
+    {
+      blk->nextfree->prevfree = blk->prevfree;
+    }
+}
+
+// set the free bit, the footer and the neighbour's prev free bit
+static void
+markFree(block_t* blk)
+{
+  blk->size |= BLOCKFREE;
+  FOOTER(blk) = BLOCKSIZE(blk);
+  NEXTBLOCK(blk)->size |= PREVFREE;
+}
+
+// turn a new page into one free block followed by the sentinel
+static void
+addPage()
+{
+  kma_page_t* page = get_page();
+  block_t* blk = (block_t*)(page->ptr + FIRSTBLOCK);
+  
+  *((kma_page_t**)page->ptr) = page;
+  blk->size = PAGEBLOCK;
+  NEXTBLOCK(blk)->size = 0;
+  markFree(blk);
+  insertBlock(blk);
+}
+
+static void
+releasePage(block_t* blk)
+{
+  assert(BLOCKSIZE(blk) == PAGEBLOCK);
+  
+  removeBlock(blk);
+  free_page(*((kma_page_t**)BASEADDR(blk)));
+}
+
+#endif // KMA_TLSF